@@ -2,10 +2,22 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <cstring>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <chrono>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#ifdef __linux__
+#define HEADLESS_EGL // offscreen rendering through EGL, see initHeadless()
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
@@ -18,9 +30,19 @@ struct VAO {
     GLuint VertexBuffer;
     GLuint ColorBuffer;
 
+    GLuint IndexBuffer;  // element buffer, 0 when drawn unindexed
+
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;
+    GLenum IndexType;    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+
+    // Vertex layout, chosen when the mesh is created
+    int Format;          // one of VertexFormat
+    GLenum PositionType; // GL_FLOAT or GL_HALF_FLOAT
+    GLenum ColorType;    // GL_FLOAT or normalized GL_UNSIGNED_BYTE
+    GLsizei Stride;      // bytes per vertex, 0 for the separate layout
 };
 typedef struct VAO VAO;
 
@@ -28,11 +50,172 @@ struct GLMatrices {
   glm::mat4 projection;
   glm::mat4 model;
   glm::mat4 view;
-  GLuint MatrixID;
+  GLint ModelID;        // "Model" uniform of programID
+  GLuint CameraBuffer;  // "Camera" uniform block
+  glm::mat4 CameraUploaded;
 } Matrices;
 
+const GLuint CAMERA_BINDING = 0; // uniform buffer binding point of the camera block
+
 GLuint programID;
 
+/* Shadow copy of the GL state. Every state change goes through the state*
+   functions below, which skip calls that would not change anything. */
+struct GLStateCache {
+    GLuint Program;
+    GLuint VertexArray;
+    GLuint ArrayBuffer, UniformBuffer;
+    GLenum PolygonMode;
+    GLenum DepthFunc;
+    GLfloat ClearColor[4];
+    GLdouble ClearDepth;
+    GLint Viewport[4];
+    map<GLenum, bool> Capabilities;
+    map<GLuint, unsigned> EnabledAttribs;               // per VAO, bit i = attribute i
+    map< pair<GLuint,GLint>, glm::mat4 > MatrixUniforms; // last value per (program, location)
+
+    unsigned long Issued;  // calls that reached the driver
+    unsigned long Skipped; // calls elided as no-ops
+} GLState = { 0, 0, 0, 0, GL_FILL, GL_LESS, {0, 0, 0, 0}, 1.0, {-1, -1, -1, -1} };
+
+/* Returns true (and counts it) when the call has to be issued */
+bool stateChanged (bool changed)
+{
+    if (changed)
+        GLState.Issued++;
+    else
+        GLState.Skipped++;
+    return changed;
+}
+
+void stateUseProgram (GLuint program)
+{
+    if (stateChanged(GLState.Program != program)) {
+        GLState.Program = program;
+        glUseProgram (program);
+    }
+}
+
+void stateBindVertexArray (GLuint vertexArray)
+{
+    if (stateChanged(GLState.VertexArray != vertexArray)) {
+        GLState.VertexArray = vertexArray;
+        glBindVertexArray (vertexArray);
+    }
+}
+
+void stateBindBuffer (GLenum target, GLuint buffer)
+{
+    // The array and uniform buffer bindings are shadowed. The element buffer
+    // is VAO state, and the other targets are not tracked: always issued
+    GLuint* bound = target == GL_ARRAY_BUFFER ? &GLState.ArrayBuffer : target == GL_UNIFORM_BUFFER ? &GLState.UniformBuffer : NULL;
+    if (bound == NULL) {
+        stateChanged(true);
+        glBindBuffer (target, buffer);
+    }
+    else if (stateChanged(*bound != buffer)) {
+        *bound = buffer;
+        glBindBuffer (target, buffer);
+    }
+}
+
+void stateEnableVertexAttribArray (GLuint index)
+{
+    unsigned& enabled = GLState.EnabledAttribs[GLState.VertexArray];
+    if (stateChanged(!(enabled & (1u << index)))) {
+        enabled |= (1u << index);
+        glEnableVertexAttribArray (index);
+    }
+}
+
+void statePolygonMode (GLenum mode)
+{
+    if (stateChanged(GLState.PolygonMode != mode)) {
+        GLState.PolygonMode = mode;
+        glPolygonMode (GL_FRONT_AND_BACK, mode);
+    }
+}
+
+void stateEnable (GLenum capability)
+{
+    bool& enabled = GLState.Capabilities[capability];
+    if (stateChanged(!enabled)) {
+        enabled = true;
+        glEnable (capability);
+    }
+}
+
+void stateDisable (GLenum capability)
+{
+    bool& enabled = GLState.Capabilities[capability];
+    if (stateChanged(enabled)) {
+        enabled = false;
+        glDisable (capability);
+    }
+}
+
+void stateDepthFunc (GLenum func)
+{
+    if (stateChanged(GLState.DepthFunc != func)) {
+        GLState.DepthFunc = func;
+        glDepthFunc (func);
+    }
+}
+
+void stateClearColor (GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
+{
+    GLfloat color[4] = { red, green, blue, alpha };
+    if (stateChanged(memcmp(GLState.ClearColor, color, sizeof(color)) != 0)) {
+        memcpy(GLState.ClearColor, color, sizeof(color));
+        glClearColor (red, green, blue, alpha);
+    }
+}
+
+void stateClearDepth (GLdouble depth)
+{
+    if (stateChanged(GLState.ClearDepth != depth)) {
+        GLState.ClearDepth = depth;
+        glClearDepth (depth);
+    }
+}
+
+void stateViewport (GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    GLint viewport[4] = { x, y, width, height };
+    if (stateChanged(memcmp(GLState.Viewport, viewport, sizeof(viewport)) != 0)) {
+        memcpy(GLState.Viewport, viewport, sizeof(viewport));
+        glViewport (x, y, width, height);
+    }
+}
+
+/* Deleting a bound buffer unbinds it, keep the shadow copy in step */
+void stateDeleteBuffer (GLuint buffer)
+{
+    if (GLState.ArrayBuffer == buffer)
+        GLState.ArrayBuffer = 0;
+    if (GLState.UniformBuffer == buffer)
+        GLState.UniformBuffer = 0;
+    stateChanged(true);
+    glDeleteBuffers(1, &buffer);
+}
+
+/* Uniform values belong to the program, so the cache is keyed by the bound program */
+void stateUniformMatrix4fv (GLint location, const glm::mat4& matrix)
+{
+    pair<GLuint,GLint> key(GLState.Program, location);
+    map< pair<GLuint,GLint>, glm::mat4 >::iterator cached = GLState.MatrixUniforms.find(key);
+    if (stateChanged(cached == GLState.MatrixUniforms.end() || memcmp(&cached->second[0][0], &matrix[0][0], sizeof(glm::mat4)) != 0)) {
+        GLState.MatrixUniforms[key] = matrix;
+        glUniformMatrix4fv(location, 1, GL_FALSE, &matrix[0][0]);
+    }
+}
+
+void printGLStateCounters ()
+{
+    unsigned long total = GLState.Issued + GLState.Skipped;
+    printf("GL state calls: %lu issued, %lu skipped (%.1f%% elided)\n", GLState.Issued, GLState.Skipped, total ? 100.0*GLState.Skipped/total : 0.0);
+}
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
@@ -115,8 +298,12 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+void printStreamCounters (); // with the stream buffer, below
+
 void quit(GLFWwindow *window)
 {
+    printGLStateCounters();
+    printStreamCounters();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
@@ -127,22 +314,133 @@ float sqr(float x)
   return x*x;
 }
 
+/* Vertex layouts a mesh can be stored in */
+enum VertexFormat {
+    VERTEX_SEPARATE_FLOAT, // two VBOs, 3 floats per vertex each
+    VERTEX_PACKED_FLOAT,   // one interleaved VBO: float xyz + normalized ubyte rgb (16 bytes)
+    VERTEX_PACKED_HALF,    // one interleaved VBO: half float xyz + normalized ubyte rgb (12 bytes)
+    VERTEX_PACKED_AUTO     // packed half if the positions survive it, packed float otherwise
+};
+
+/* Largest position error (in world units) accepted for half float positions */
+const float HALF_POSITION_TOLERANCE = 1.0f/1024;
+
+/* IEEE 754 binary16 conversion, round to nearest */
+GLushort floatToHalf (float value)
+{
+    GLuint bits;
+    memcpy(&bits, &value, sizeof(bits));
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = bits & 0x7fffff;
+
+    if (exponent <= 0) { // too small for a normal half: subnormal or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        GLuint half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1)
+            half++;
+        return sign | half;
+    }
+    if (exponent >= 31) // overflow, clamp to infinity
+        return sign | 0x7c00;
+
+    GLuint half = (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000) // a carry into the exponent is still correct
+        half++;
+    return sign | half;
+}
+
+float halfToFloat (GLushort half)
+{
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    float value;
+    if (exponent == 0)
+        value = ldexp((float)mantissa, -24);
+    else if (exponent == 31)
+        value = INFINITY;
+    else
+        value = ldexp((float)(mantissa | 0x400), exponent - 25);
+    return (half & 0x8000) ? -value : value;
+}
+
+/* Pick the layout for a mesh: half float positions only when they stay within tolerance */
+VertexFormat negotiateVertexFormat (VertexFormat requested, int numVertices, const GLfloat* vertex_buffer_data)
+{
+    if (requested != VERTEX_PACKED_AUTO)
+        return requested;
+    for (int i=0; i<3*numVertices; i++) {
+        if (fabs(halfToFloat(floatToHalf(vertex_buffer_data[i])) - vertex_buffer_data[i]) > HALF_POSITION_TOLERANCE)
+            return VERTEX_PACKED_FLOAT;
+    }
+    return VERTEX_PACKED_HALF;
+}
+
+GLubyte colorToByte (GLfloat value)
+{
+    value = value < 0 ? 0 : (value > 1 ? 1 : value);
+    return (GLubyte)(value*255.0f + 0.5f);
+}
+
 /* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_PACKED_AUTO)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->IndexBuffer = 0;
+    vao->NumIndices = 0;
+    vao->IndexType = GL_UNSIGNED_SHORT;
+    format = negotiateVertexFormat(format, numVertices, vertex_buffer_data);
+    vao->Format = format;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+
+    if (format != VERTEX_SEPARATE_FLOAT) {
+        // Interleaved: position, then color, in one VBO
+        bool half = (format == VERTEX_PACKED_HALF);
+        GLsizei positionSize = half ? 4*sizeof(GLushort) : 3*sizeof(GLfloat); // half xyz is padded to 8 bytes
+        vao->PositionType = half ? GL_HALF_FLOAT : GL_FLOAT;
+        vao->ColorType = GL_UNSIGNED_BYTE;
+        vao->Stride = positionSize + 4*sizeof(GLubyte);
+        vao->ColorBuffer = 0;
+
+        vector<GLubyte> packed(numVertices*vao->Stride, 0);
+        for (int i=0; i<numVertices; i++) {
+            GLubyte* vertex = &packed[i*vao->Stride];
+            for (int c=0; c<3; c++) {
+                if (half) {
+                    GLushort h = floatToHalf(vertex_buffer_data[3*i + c]);
+                    memcpy(vertex + c*sizeof(GLushort), &h, sizeof(h));
+                }
+                else
+                    memcpy(vertex + c*sizeof(GLfloat), &vertex_buffer_data[3*i + c], sizeof(GLfloat));
+                vertex[positionSize + c] = colorToByte(color_buffer_data[3*i + c]);
+            }
+            vertex[positionSize + 3] = 255;
+        }
+
+        stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the interleaved VBO
+        glBufferData (GL_ARRAY_BUFFER, packed.size(), packed.empty() ? NULL : &packed[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, vao->PositionType, GL_FALSE, vao->Stride, (void*)0); // attribute 0. Vertices
+        glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, vao->Stride, (void*)(size_t)positionSize); // attribute 1. Color, 0-255 -> 0-1
+        return vao;
+    }
+
+    vao->PositionType = GL_FLOAT;
+    vao->ColorType = GL_FLOAT;
+    vao->Stride = 0;
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
@@ -153,7 +451,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           (void*)0            // array buffer offset
                           );
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
@@ -168,7 +466,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 }
 
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_PACKED_AUTO)
 {
     GLfloat* color_buffer_data = new GLfloat [3*numVertices];
     for (int i=0; i<numVertices; i++) {
@@ -177,38 +475,360 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode, format);
+}
+
+/* Collects triangles and welds identical position/color pairs into an indexed mesh */
+struct MeshBuilder {
+    vector<GLfloat> Positions; // 3 per unique vertex
+    vector<GLfloat> Colors;    // 3 per unique vertex
+    vector<GLuint> Indices;    // one per emitted vertex
+    map< array<GLfloat,6>, GLuint > Lookup;
+};
+
+GLuint addVertex (MeshBuilder& mesh, const GLfloat* position, const GLfloat* color)
+{
+    array<GLfloat,6> key = {{ position[0], position[1], position[2], color[0], color[1], color[2] }};
+    map< array<GLfloat,6>, GLuint >::iterator found = mesh.Lookup.find(key);
+    GLuint index;
+    if (found != mesh.Lookup.end())
+        index = found->second;
+    else {
+        index = mesh.Positions.size()/3;
+        mesh.Positions.insert(mesh.Positions.end(), position, position + 3);
+        mesh.Colors.insert(mesh.Colors.end(), color, color + 3);
+        mesh.Lookup[key] = index;
+    }
+    mesh.Indices.push_back(index);
+    return index;
+}
+
+/* Append unindexed vertex/color arrays (the create3DObject inputs) to the builder */
+void addVertices (MeshBuilder& mesh, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+    for (int i=0; i<numVertices; i++)
+        addVertex(mesh, &vertex_buffer_data[3*i], &color_buffer_data[3*i]);
+}
+
+/* Generate VAO, VBOs and an element buffer for the welded mesh */
+struct VAO* create3DObjectIndexed (GLenum primitive_mode, const MeshBuilder& mesh, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_PACKED_AUTO)
+{
+    int numVertices = mesh.Positions.size()/3;
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, &mesh.Positions[0], &mesh.Colors[0], fill_mode, format);
+    vao->NumIndices = mesh.Indices.size();
+
+    glGenBuffers (1, &(vao->IndexBuffer)); // EBO - indices
+    stateBindVertexArray (vao->VertexArrayID); // the element buffer binding is VAO state
+    stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+    if (numVertices <= 65536) {
+        vector<GLushort> shortIndices(mesh.Indices.begin(), mesh.Indices.end());
+        vao->IndexType = GL_UNSIGNED_SHORT;
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, shortIndices.size()*sizeof(GLushort), &shortIndices[0], GL_STATIC_DRAW);
+    }
+    else {
+        vao->IndexType = GL_UNSIGNED_INT;
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, mesh.Indices.size()*sizeof(GLuint), &mesh.Indices[0], GL_STATIC_DRAW);
+    }
+    return vao;
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    statePolygonMode (vao->FillMode);
 
     // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    stateBindVertexArray (vao->VertexArrayID);
 
     // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
+    stateEnableVertexAttribArray(0);
     // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
 
     // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    stateEnableVertexAttribArray(1);
+    // Bind the VBO to use (interleaved layouts keep colors in the vertex VBO)
+    if (vao->ColorBuffer != 0)
+        stateBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer);
 
     // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    if (vao->IndexBuffer != 0)
+        glDrawElements(vao->PrimitiveMode, vao->NumIndices, vao->IndexType, (void*)0);
+    else
+        glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
+
+/* Render vertices [first, first+count) of an unindexed VAO */
+void draw3DObjectRange (struct VAO* vao, int first, int count)
+{
+    statePolygonMode (vao->FillMode);
+    stateBindVertexArray (vao->VertexArrayID);
+    glDrawArrays(vao->PrimitiveMode, first, count);
+}
+
+/* A queued draw: which mesh, with which program/fill mode, and where */
+struct RenderCommand {
+    int Layer;          // lower layers draw first; state sorting happens within a layer
+    GLuint Program;
+    GLint ModelID;      // "Model" uniform of Program, -1 if it has none
+    struct VAO* Object;
+    GLenum FillMode;
+    int First, Count;   // vertex range to draw; Count 0 draws the whole VAO
+    glm::mat4 Model;
+};
+
+vector<RenderCommand> renderQueue;
+
+/* Queue obj for this frame; it is drawn by flushRenderQueue() */
+void submitDraw (struct VAO* obj, const glm::mat4& model, int layer=0)
+{
+    RenderCommand command;
+    command.Layer = layer;
+    command.Program = programID;
+    command.ModelID = Matrices.ModelID;
+    command.Object = obj;
+    command.FillMode = obj->FillMode;
+    command.First = 0;
+    command.Count = 0;
+    command.Model = model;
+    renderQueue.push_back(command);
+}
+
+/* Vertex of streamed geometry, laid out like VERTEX_PACKED_FLOAT */
+struct StreamVertex {
+    GLfloat Position[3];
+    GLubyte Color[4];
+};
+
+/* Geometry that moves every frame, kept on the CPU as a plain triangle list */
+struct DynamicMesh {
+    vector<GLfloat> Positions; // 3 per vertex
+    vector<GLfloat> Colors;    // 3 per vertex
+};
+
+/* Ring of per-frame regions that moving geometry is written into, already
+   transformed, so it can be drawn in a few large draws. With
+   GL_ARB_buffer_storage the buffer stays persistently mapped and each region
+   is fenced; otherwise the buffer is orphaned every frame. */
+const int STREAM_REGIONS = 3; // frames the GPU may lag behind
+
+struct StreamBuffer {
+    struct VAO* Object;     // unindexed GL_TRIANGLES, VertexBuffer is the ring
+    GLsizeiptr RegionSize;  // bytes, a multiple of sizeof(StreamVertex)
+    int Region;             // region written this frame
+    bool Persistent;
+    GLubyte* Mapped;        // start of the ring when persistent
+    GLsync Fences[STREAM_REGIONS];
+    unsigned long Stalls;   // frames that had to wait for the GPU anyway
+} streamBuffer = { NULL, 0, 0, false, NULL, { 0 }, 0 };
+
+map< int, vector<StreamVertex> > streamBatches; // this frame's vertices, per layer
+
+void allocateStreamBuffer (GLsizeiptr regionSize)
+{
+    struct VAO* vao = streamBuffer.Object;
+    if (vao == NULL) {
+        vao = new struct VAO;
+        memset(vao, 0, sizeof(struct VAO));
+        vao->PrimitiveMode = GL_TRIANGLES;
+        vao->FillMode = GL_FILL;
+        vao->Format = VERTEX_PACKED_FLOAT;
+        vao->PositionType = GL_FLOAT;
+        vao->ColorType = GL_UNSIGNED_BYTE;
+        vao->Stride = sizeof(StreamVertex);
+        glGenVertexArrays(1, &(vao->VertexArrayID));
+        streamBuffer.Object = vao;
+    }
+    else
+        stateDeleteBuffer(vao->VertexBuffer); // also unmaps it; draws already queued keep their data
+    for (int i=0; i<STREAM_REGIONS; i++) {
+        if (streamBuffer.Fences[i])
+            glDeleteSync(streamBuffer.Fences[i]);
+        streamBuffer.Fences[i] = 0;
+    }
+    streamBuffer.RegionSize = regionSize - regionSize % sizeof(StreamVertex);
+    streamBuffer.Region = 0;
+    streamBuffer.Mapped = NULL;
+
+    glGenBuffers (1, &(vao->VertexBuffer));
+    stateBindVertexArray (vao->VertexArrayID);
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    streamBuffer.Persistent = GLAD_GL_ARB_buffer_storage != 0;
+    if (streamBuffer.Persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, STREAM_REGIONS*streamBuffer.RegionSize, NULL, flags);
+        streamBuffer.Mapped = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, STREAM_REGIONS*streamBuffer.RegionSize, flags);
+        if (streamBuffer.Mapped == NULL) { // storage is immutable, start over with a plain buffer
+            streamBuffer.Persistent = false;
+            stateDeleteBuffer(vao->VertexBuffer);
+            glGenBuffers (1, &(vao->VertexBuffer));
+            stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+        }
+    }
+    if (!streamBuffer.Persistent)
+        glBufferData (GL_ARRAY_BUFFER, streamBuffer.RegionSize, NULL, GL_STREAM_DRAW);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(StreamVertex), (void*)offsetof(StreamVertex, Position)); // attribute 0. Vertices
+    glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(StreamVertex), (void*)offsetof(StreamVertex, Color)); // attribute 1. Color
+    stateEnableVertexAttribArray(0);
+    stateEnableVertexAttribArray(1);
+}
+
+/* Queue mesh, transformed by model on the CPU, into this frame's stream batch */
+void submitDynamic (const DynamicMesh& mesh, const glm::mat4& model, int layer=0)
+{
+    vector<StreamVertex>& batch = streamBatches[layer];
+    size_t numVertices = mesh.Positions.size()/3;
+    for (size_t i=0; i<numVertices; i++) {
+        glm::vec4 position = model * glm::vec4(mesh.Positions[3*i], mesh.Positions[3*i + 1], mesh.Positions[3*i + 2], 1);
+        StreamVertex vertex;
+        vertex.Position[0] = position.x;
+        vertex.Position[1] = position.y;
+        vertex.Position[2] = position.z;
+        for (int c=0; c<3; c++)
+            vertex.Color[c] = colorToByte(mesh.Colors[3*i + c]);
+        vertex.Color[3] = 255;
+        batch.push_back(vertex);
+    }
+}
+
+/* Copy this frame's batches into the next ring region and queue one draw per layer */
+void uploadStreamBatches ()
+{
+    size_t numVertices = 0;
+    for (map< int, vector<StreamVertex> >::iterator it = streamBatches.begin(); it != streamBatches.end(); ++it)
+        numVertices += it->second.size();
+    if (numVertices == 0)
+        return;
+
+    GLsizeiptr bytes = numVertices*sizeof(StreamVertex);
+    if (streamBuffer.Object == NULL || bytes > streamBuffer.RegionSize)
+        allocateStreamBuffer(max(2*bytes, (GLsizeiptr)65536));
+
+    GLubyte* destination;
+    int first = 0;
+    if (streamBuffer.Persistent) {
+        int region = (streamBuffer.Region + 1) % STREAM_REGIONS;
+        GLsync& fence = streamBuffer.Fences[region];
+        if (fence) {
+            // Normally signalled long ago; only block if the GPU is a whole ring
+            // behind, and then for as long as it takes, since it still reads the region
+            GLenum waited = glClientWaitSync(fence, 0, 0);
+            if (waited == GL_TIMEOUT_EXPIRED) {
+                streamBuffer.Stalls++;
+                do
+                    waited = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+                while (waited == GL_TIMEOUT_EXPIRED);
+            }
+            if (waited == GL_WAIT_FAILED)
+                glFinish(); // the fence cannot say; wait until the GPU is done with everything
+            glDeleteSync(fence);
+            fence = 0;
+        }
+        streamBuffer.Region = region;
+        destination = streamBuffer.Mapped + region*streamBuffer.RegionSize;
+        first = region*streamBuffer.RegionSize/sizeof(StreamVertex);
+    }
+    else {
+        // Orphan the old storage, the driver hands back a fresh block without waiting
+        stateBindBuffer (GL_ARRAY_BUFFER, streamBuffer.Object->VertexBuffer);
+        glBufferData (GL_ARRAY_BUFFER, streamBuffer.RegionSize, NULL, GL_STREAM_DRAW);
+        destination = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+
+    for (map< int, vector<StreamVertex> >::iterator it = streamBatches.begin(); it != streamBatches.end(); ++it) {
+        int count = it->second.size();
+        if (count == 0)
+            continue;
+        memcpy(destination, &it->second[0], count*sizeof(StreamVertex));
+        destination += count*sizeof(StreamVertex);
+
+        submitDraw(streamBuffer.Object, glm::mat4(1.0f), it->first);
+        renderQueue.back().First = first;
+        renderQueue.back().Count = count;
+        first += count;
+        it->second.clear(); // keeps the capacity for the next frame
+    }
+
+    if (!streamBuffer.Persistent)
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+/* Called once the frame's draws are issued: the region is reusable when this fence signals */
+void fenceStreamRegion ()
+{
+    if (streamBuffer.Persistent && streamBuffer.Fences[streamBuffer.Region] == 0)
+        streamBuffer.Fences[streamBuffer.Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void printStreamCounters ()
+{
+    printf("Stream buffer: %s, %lu frames waited on the GPU\n", streamBuffer.Persistent ? "persistent" : "orphaned", streamBuffer.Stalls);
+}
+
+/* Create the camera uniform buffer and attach the Camera block of each program to it */
+void createCameraBlock (const vector<GLuint>& programs)
+{
+    glGenBuffers (1, &Matrices.CameraBuffer);
+    stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BINDING, Matrices.CameraBuffer);
+    for (size_t i=0; i<programs.size(); i++)
+        glUniformBlockBinding (programs[i], glGetUniformBlockIndex(programs[i], "Camera"), CAMERA_BINDING);
+    Matrices.CameraUploaded = glm::mat4(0.0f); // no valid camera yet, forces the first upload
+}
+
+/* Projection * View for the whole frame; skipped when the camera did not move */
+void uploadCamera ()
+{
+    glm::mat4 VP = Matrices.projection * Matrices.view;
+    if (memcmp(&VP[0][0], &Matrices.CameraUploaded[0][0], sizeof(glm::mat4)) == 0)
+        return;
+    Matrices.CameraUploaded = VP;
+    stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &VP[0][0]);
+}
+
+/* Sort key: layer, then the state each draw needs, so equal state ends up adjacent */
+bool renderCommandLess (const RenderCommand& a, const RenderCommand& b)
+{
+    if (a.Layer != b.Layer)
+        return a.Layer < b.Layer;
+    if (a.Program != b.Program)
+        return a.Program < b.Program;
+    if (a.Object->VertexArrayID != b.Object->VertexArrayID)
+        return a.Object->VertexArrayID < b.Object->VertexArrayID;
+    return a.FillMode < b.FillMode;
+}
+
+/* Sort and draw everything submitted this frame with the current camera */
+void flushRenderQueue ()
+{
+    uploadStreamBatches();
+
+    // stable: commands with the same key keep their submission order
+    stable_sort(renderQueue.begin(), renderQueue.end(), renderCommandLess);
+
+    uploadCamera();
+    for (size_t i=0; i<renderQueue.size(); i++) {
+        const RenderCommand& command = renderQueue[i];
+        stateUseProgram (command.Program);
+        if (command.ModelID >= 0)
+            stateUniformMatrix4fv(command.ModelID, command.Model);
+        if (command.Count > 0)
+            draw3DObjectRange(command.Object, command.First, command.Count);
+        else
+            draw3DObject(command.Object);
+    }
+    renderQueue.clear();
+    fenceStreamRegion();
 }
 
 /**************************
  * Customizable functions *
  **************************/
 float time_travel = 0;
-float walls_position[300][2];
-int array_postion = 0;
 float initial_velocity =20;
 float initial_velocity1 = initial_velocity;
 float angle_thrown = M_PI/3;
@@ -227,9 +847,27 @@ float coefficient_of_elasticity = 0.8;
 double xmousePos,ymousePos;
 float tanker_angle= 0;
 bool shoot =0;
-float distance1;
 float distance3;
 float power=40;
+
+/* The game advances in fixed ticks, TickRate a second (--tick-rate), however
+   often it is drawn: main() runs as many ticks as the time since the last
+   frame owes, and draw() places the bird and the pigs between where they
+   were before the last tick and where they are now. A tick is what a frame
+   used to be, so at the default 60 the game plays as it always did under
+   60 Hz vsync. */
+struct Simulation {
+  double TickRate;
+  bool Vsync;            // --no-vsync draws as fast as it can
+  float Previous[3][2];  // the bird and the two pigs, before the last tick
+} simulation = { 60, true };
+
+// Before a tick, and wherever the bird is put rather than moved
+void keepPreviousState ()
+{
+  float now[3][2] = { {horizontal_translation,vertical_translation}, {horizontal_translation1,vertical_translation1}, {horizontal_translation2,vertical_translation2} };
+  memcpy(simulation.Previous, now, sizeof(now));
+}
 float power1=0;
 float additional_angle=0;
 bool iscollide = 0,iscollide1=0;
@@ -294,6 +932,7 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
             horizontal_translation = -3 - 0.1*cos(angle_thrown);
             vertical_translation = -2  - 0.65*sin(angle_thrown);
             time_travel = 0;
+            keepPreviousState();
             break;
     case 'a':
             additional_angle +=M_PI/18;
@@ -306,6 +945,7 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
   }
 }
 float zoomX=8,zoomY=8;
+int viewport_height = 600; // framebuffer height in pixels, for circle detail
 
 void cbfun (GLFWwindow* window, double x,double y)
 {
@@ -348,6 +988,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
               horizontal_translation = -3 - 0.1*cos(angle_thrown);
               vertical_translation = -2  - 0.65*sin(angle_thrown);
               time_travel = 0;
+              keepPreviousState();
 
               //time_travel=0;
             }
@@ -372,12 +1013,14 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     int fbwidth=width, fbheight=height;
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
      is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    if (window != NULL) // NULL in headless mode, the offscreen framebuffer has the requested size
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
   GLfloat fov = 90.0f;
 
   // sets the viewport of openGL renderer
-  glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+  stateViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+  viewport_height = fbheight;
 
   // set the projection matrix as perspective
   /* glMatrixMode (GL_PROJECTION);
@@ -391,68 +1034,44 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0f, 0.1f, 500.0f);
 }
 
-VAO *triangle, *rectangle, *powerboxes, *triangle1, *scoresource, *tankercircle, *pig;
+VAO *rectangle, *powerboxes, *scoresource;
 
-// Creates the triangle object used in this sample code
-void createTriangle ()
+/* A filled disc; drawCircle() picks a cached mesh for it by size on screen */
+struct Circle {
+  float Radius;
+  GLfloat Color[3];
+};
+
+Circle triangle, triangle1, tankercircle, pig;
+
+Circle makeCircle (float radius, GLfloat red, GLfloat green, GLfloat blue)
 {
-  static const GLfloat vertex_buffer_data [] = {
-    0, 0,0, // vertex 0 
-    0,0.1,0, // vertex 1
-    0.1,0,0, // vertex 2
-  };
+  Circle circle = { radius, { red, green, blue } };
+  return circle;
+}
 
-  static const GLfloat color_buffer_data [] = {
-    1,1,1, // color 0
-    1,1,1, // color 1
-    1,1,1, // color 2
-  };
-  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+// The projectile
+void createTriangle ()
+{
+  triangle = makeCircle(0.1, 1, 1, 1);
 }
 
+// Pig eyes
 void createpig ()
 {
-  static const GLfloat vertex_buffer_data [] = {
-    0, 0,0, // vertex 0 
-    0,0.05,0, // vertex 1
-    0.05,0,0, // vertex 2
-  };
-
-  static const GLfloat color_buffer_data [] = {
-    0,0,0, // color 0
-    0,0,0, // color 1
-    0,0,0, // color 2
-  };
-  pig = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+  pig = makeCircle(0.05, 0, 0, 0);
 }
 
+// Body of the tank
 void createtankercircle ()
 {
-  static const GLfloat vertex_buffer_data [] = {
-    0, 0,0, // vertex 0 
-    0,0.5,0, // vertex 1
-    0.5,0,0, // vertex 2
-  };
-  static const GLfloat color_buffer_data [] = {
-    152/255.0, 205/255.0, 152/255.0,
-    152/255.0, 205/255.0, 152/255.0,
-    152/255.0, 205/255.0, 152/255.0,
-  };
-  tankercircle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+  tankercircle = makeCircle(0.5, 152/255.0, 205/255.0, 152/255.0);
 }
+
+// The pigs
 void createTriangle1 ()
 {
-  static const GLfloat vertex_buffer_data [] = {
-    0, 0,0, // vertex 0
-    0,0.2,0, // vertex 1
-    0.2,0,0, // vertex 2
-  };
-  static const GLfloat color_buffer_data [] = {
-    1,1,0, // color 0
-    1,1,0, // color 1
-    1,1,0, // color 2
-  };
-  triangle1 = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+  triangle1 = makeCircle(0.2, 1, 1, 0);
 }
 void createRectangle ()
 {
@@ -475,7 +1094,9 @@ void createRectangle ()
     152/255.0, 205/255.0, 152/255.0,
     152/255.0, 205/255.0, 152/255.0,  
   };
-  rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  MeshBuilder mesh;
+  addVertices(mesh, 6, vertex_buffer_data, color_buffer_data);
+  rectangle = create3DObjectIndexed(GL_TRIANGLES, mesh, GL_FILL);
 }
 
 void createPowerBoxes()
@@ -498,7 +1119,9 @@ void createPowerBoxes()
     152/255.0, 205/255.0, 152/255.0,
     152/255.0, 205/255.0, 152/255.0,  
   };
-  powerboxes = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  MeshBuilder mesh;
+  addVertices(mesh, 6, vertex_buffer_data, color_buffer_data);
+  powerboxes = create3DObjectIndexed(GL_TRIANGLES, mesh, GL_FILL);
 }
 
 
@@ -522,145 +1145,514 @@ void scorerectangle()
     152/255.0, 205/255.0, 152/255.0,
     152/255.0, 205/255.0, 152/255.0,  
   };
-  scoresource = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  MeshBuilder mesh;
+  addVertices(mesh, 6, vertex_buffer_data, color_buffer_data);
+  scoresource = create3DObjectIndexed(GL_TRIANGLES, mesh, GL_FILL);
 }
 
+/* Draw layers: everything sits at z=0 with GL_LEQUAL, so later layers draw on
+   top. Within a layer draws are sorted by state, not kept in order, so
+   anything that overlaps gets a layer of its own, in the order the scene
+   always drew them */
+const int LAYER_TANK = 0;  // tank body and barrel, under the projectile
+const int LAYER_BIRDS = 1; // the projectile and the pigs, under the walls
+const int LAYER_SCENE = 2; // walls and the power bar
+const int LAYER_SCORE = 3; // score digits, over the power bar
+const int LAYER_EYES = 4;  // pig eyes, on top of the birds
+
 float camera_rotation_angle = 90;
 float rectangle_rotation = 0;
 float triangle_rotation = 0;
 
-void drawing_walls(float x_centre,float y_centre,VAO* obj)
+void drawing_walls(float x_centre,float y_centre,VAO* obj,int layer=LAYER_SCENE)
 {
-  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane 
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-  glm::mat4 MVP;  // MVP = Projection * View * Model
   Matrices.model = glm::mat4(1.0f);
   glm::mat4 translateRectangle = glm::translate (glm::vec3(x_centre,y_centre, 0));        // glTranslatef
   Matrices.model *= translateRectangle;
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(obj); 
+  submitDraw(obj, Matrices.model, layer);
 }
-void wall_collision(float x_centre,float y_centre,VAO* obj)
+float ar[8],br[8];
+
+/* Swept collision. Within a tick a projectile goes from where it was to
+   where the tick leaves it, near enough in a straight line. These find the
+   fraction of the way along that line at which a circle first touches
+   something, or -1 if it does not. A shot can then be as fast as it likes
+   without passing through a pig or the tower. Touching at the start counts
+   only when moving further in */
+
+// Against a circle at rest at c, for radius the two radii summed
+float sweptCircleCircle (glm::vec2 a, glm::vec2 b, glm::vec2 c, float radius)
+{
+  glm::vec2 p = a - c, d = b - a;
+  float A = glm::dot(d, d), B = glm::dot(p, d), C = glm::dot(p, p) - radius*radius;
+  if(B >= 0)
+    return -1;   // not closing in
+  if(C <= 0)
+    return 0;
+  float discriminant = B*B - A*C;
+  if(discriminant < 0)
+    return -1;
+  float t = (-B - sqrt(discriminant))/A;
+  return t <= 1 ? t : -1;
+}
+
+struct Box {
+  glm::vec2 Min, Max;
+};
+
+const Box TOWER = { glm::vec2(0.5, -3.9), glm::vec2(1.1, -1.9) }; // the stack of boxes the first pig stands on
+
+// Against a box: the box grown by the radius, round at the corners. normal
+// is the way out of the side it touches, or away from the corner
+float sweptCircleBox (glm::vec2 a, glm::vec2 b, float radius, const Box& box, glm::vec2& normal)
 {
-  drawing_walls(x_centre,y_centre,obj);
-  for(int ii=0;ii<=5;ii+=1)
+  glm::vec2 d = b - a;
+  float enter = -1, leave = 2;
+  int axis = 0;
+  for(int i=0; i<2; i++)
   {
-    walls_position[array_postion][0]=x_centre;
-    walls_position[array_postion][1]=-0.5+0.2*ii+y_centre;
-    array_postion++;
+    float low = box.Min[i] - radius, high = box.Max[i] + radius;
+    if(d[i] == 0)
+    {
+      if(a[i] < low || a[i] > high)
+        return -1;
+      continue;
+    }
+    float t0 = (low - a[i])/d[i], t1 = (high - a[i])/d[i];
+    if(t0 > t1)
+      swap(t0, t1);
+    if(t0 > enter)
+    {
+      enter = t0;
+      axis = i;
+    }
+    leave = min(leave, t1);
   }
-  for(int iii=0;iii<array_postion;iii++)
+  if(enter > leave || enter > 1 || leave < 0)
+    return -1;
+
+  // Beyond the box on both axes, it meets the rounded corner or nothing
+  glm::vec2 p = a + max(enter, 0.0f)*d, corner = glm::clamp(p, box.Min, box.Max);
+  if(p.x != corner.x && p.y != corner.y)
   {
-    distance1 = sqrt((sqr(walls_position[iii][0]-horizontal_translation)) + (sqr(walls_position[iii][1]-vertical_translation)));
-    if(distance1<=0.2)
-    {
-      initial_velocity *= -1*0.8;
-      if(horizontal_translation<x_centre && ((y_centre-0.55)<vertical_translation) &&  vertical_translation<(y_centre+0.55))
-      {
-        horizontal_translation = -0.2+x_centre;
-        // cout << "2" << endl;
-      }
-      else if(horizontal_translation>x_centre && ((x_centre-0.55)<vertical_translation<(x_centre+0.55)))
-      {
-        horizontal_translation = x_centre + 0.2;
-        // cout << "3" << endl;
-      }
-      else
+    float t = sweptCircleCircle(a, b, corner, radius);
+    if(t >= 0)
+      normal = glm::normalize(a + t*d - corner);
+    return t;
+  }
+  normal = glm::vec2(0, 0);
+  if(enter >= 0)
+    normal[axis] = d[axis] > 0 ? -1 : 1;
+  else
+  {
+    // Touching at the start: out through the nearest side
+    float nearest = 1e30;
+    for(int i=0; i<2; i++)
+      for(int side=-1; side<=1; side+=2)
       {
-        
-        if(horizontal_translation<3)
+        float depth = side < 0 ? a[i] - (box.Min[i] - radius) : box.Max[i] + radius - a[i];
+        if(depth < nearest)
         {
-          initial_velocity1 *= 0.5;
-          vertical_translation = y_centre + 0.9;
-          initial_velocity *= -1*coefficient_of_elasticity;
+          nearest = depth;
+          normal = glm::vec2(0, 0);
+          normal[i] = side;
         }
-        // cout << initial_velocity << " " <<  initial_velocity1 << endl;
-        time_travel = 0;
-        // cout << "1" << endl; 
-               // cout << y_centre-0.6  << " " <<  vertical_translation << " " << y_centre+0.6 << endl;
-        // cout << horizontal_translation << " " << x_centre << endl;
       }
-    } 
+    enter = 0;
   }
+  return glm::dot(d, normal) < 0 ? enter : -1;
 }
-float ar[8],br[10];
-void bird_collision(float horizontal_translation,float vertical_translation,float horizontal_translation1,float vertical_translation1,float initial_velocity,float initial_velocity1,float initial_velocity2,float initial_velocity3,float time_travel,float time_travel1)
+
+/* Walls: boxes the bird and the pigs bounce off. They are found through a
+   uniform grid of WALL_CELL squares over them, built once by buildWallGrid()
+   with every wall in each cell it covers, so a projectile tests only the
+   walls in the few cells its way through a tick crosses, however many
+   walls there are */
+const float WALL_CELL = 0.4;
+
+struct WallGrid {
+  vector<Box> Walls;
+  glm::vec2 Origin;         // the low corner of cell (0, 0)
+  int Rows, Columns;
+  vector<int> CellStart;    // cell c holds CellItems[CellStart[c] .. CellStart[c+1])
+  vector<int> CellItems;
+  vector<unsigned> Seen;    // per wall, the last query that tested it
+  unsigned Queries;
+} walls;
+
+// The cell a point is in, along one axis, clamped to the grid
+int wallCell (float position, int axis)
 {
-  // float distance4 = sqrt((sqr(walls_position[iii][0]-horizontal_translation1)) + (sqr(walls_position[iii][1]-vertical_translation1)));
-  if((horizontal_translation>0.4 && horizontal_translation<0.9) && (vertical_translation<-1.9))
+  int cell = (int)floor((position - walls.Origin[axis])/WALL_CELL);
+  return min(max(cell, 0), (axis ? walls.Rows : walls.Columns) - 1);
+}
+
+void buildWallGrid ()
+{
+  WallGrid& g = walls;
+  int count = g.Walls.size();
+  Box extent = { glm::vec2(0, 0), glm::vec2(0, 0) };
+  for(int i=0; i<count; i++)
   {
-    initial_velocity *= -1*0.8;
-    horizontal_translation = 0.3;
+    const Box& bounds = g.Walls[i];
+    extent.Min = i ? glm::vec2(min(extent.Min.x, bounds.Min.x), min(extent.Min.y, bounds.Min.y)) : bounds.Min;
+    extent.Max = i ? glm::vec2(max(extent.Max.x, bounds.Max.x), max(extent.Max.y, bounds.Max.y)) : bounds.Max;
   }
-  if((horizontal_translation1>0.4 && horizontal_translation1<0.9) && (vertical_translation1<-1.8))
+  g.Origin = extent.Min;
+  g.Columns = max(1, (int)ceil((extent.Max.x - extent.Min.x)/WALL_CELL));
+  g.Rows = max(1, (int)ceil((extent.Max.y - extent.Min.y)/WALL_CELL));
+  g.CellStart.assign(g.Rows*g.Columns + 1, 0);
+  for(int pass=0; pass<2; pass++)
   {
-    initial_velocity2 *= -1*0.8;
-    horizontal_translation1 = 0.3;
+    for(int i=0; i<count; i++)
+    {
+      const Box& bounds = g.Walls[i];
+      for(int r=wallCell(bounds.Min.y, 1); r<=wallCell(bounds.Max.y, 1); r++)
+        for(int c=wallCell(bounds.Min.x, 0); c<=wallCell(bounds.Max.x, 0); c++)
+        {
+          int cell = r*g.Columns + c;
+          if(pass == 0)
+            g.CellStart[cell+1]++;
+          else
+            g.CellItems[g.CellStart[cell]++] = i;
+        }
+    }
+    if(pass == 0)
+    {
+      for(size_t c=1; c<g.CellStart.size(); c++)
+        g.CellStart[c] += g.CellStart[c-1];
+      g.CellItems.resize(g.CellStart.back());
+    }
+    else
+    {
+      // Filling moved every start onto the next cell's; move them back
+      for(size_t c=g.CellStart.size()-1; c>0; c--)
+        g.CellStart[c] = g.CellStart[c-1];
+      g.CellStart[0] = 0;
+    }
+  }
+  g.Seen.assign(count, 0);
+  g.Queries = 0;
+}
+
+// The walls of the scene: for now the tower the first pig stands on. The
+// boxes drawn along the edges of the screen are scenery, not walls
+void createWalls ()
+{
+  walls.Walls.assign(1, TOWER);
+  buildWallGrid();
+}
+
+// The fraction of the way from "from" to "to" at which a circle first touches
+// a wall, and the side it touches, or -1
+float firstWallHit (glm::vec2 from, glm::vec2 to, float radius, glm::vec2& normal)
+{
+  WallGrid& g = walls;
+  float first = -1;
+  if(g.Walls.empty())
+    return first;
+  unsigned query = ++g.Queries;
+  if(query == 0)
+  {
+    // Wrapped: forget the stamps, which could match the queries to come
+    fill(g.Seen.begin(), g.Seen.end(), 0);
+    query = g.Queries = 1;
   }
-  if((horizontal_translation>0.9 && horizontal_translation<1.2) && (vertical_translation<-1.9))
+  int lowRow = wallCell(min(from.y, to.y) - radius, 1), highRow = wallCell(max(from.y, to.y) + radius, 1);
+  int lowColumn = wallCell(min(from.x, to.x) - radius, 0), highColumn = wallCell(max(from.x, to.x) + radius, 0);
+  for(int r=lowRow; r<=highRow; r++)
+    for(int c=lowColumn; c<=highColumn; c++)
+    {
+      int cell = r*g.Columns + c;
+      for(int k=g.CellStart[cell]; k<g.CellStart[cell+1]; k++)
+      {
+        int i = g.CellItems[k];
+        if(g.Seen[i] == query)
+          continue;
+        g.Seen[i] = query;
+        glm::vec2 side;
+        float t = sweptCircleBox(from, to, radius, g.Walls[i], side);
+        if(t >= 0 && (first < 0 || t < first))
+        {
+          first = t;
+          normal = side;
+        }
+      }
+    }
+  return first;
+}
+
+// Stops a projectile where its way from "from" first touches a wall and
+// bounces it: back along x off a side, up off a top as off the ground
+void bounceOffWalls (glm::vec2 from, float radius, float& x, float& y, float& along, float& up, float& fall)
+{
+  glm::vec2 to(x, y), normal;
+  float first = firstWallHit(from, to, radius, normal);
+  if(first < 0)
+    return;
+  glm::vec2 contact = glm::mix(from, to, first);
+  x = contact.x;
+  y = contact.y;
+  if(fabs(normal.x) > fabs(normal.y))
+    along *= -1*0.8;
+  else
   {
-    initial_velocity *= -1*0.8;
-    horizontal_translation = 1.2;
+    fall = 0;
+    up *= coefficient_of_elasticity;
+    if(up<0)
+      up *= -1;
   }
-  if((horizontal_translation1>0.9 && horizontal_translation1<1.3) && (vertical_translation1<-1.8))
+}
+
+/* --check-walls: firstWallHit() against testing every wall, for random ways
+   through a field of random walls far bigger than the scene's. Any way the
+   two answer differently fails the check, but for which of several walls
+   touched at once gives the side; prints what a query costs each way */
+bool checkWalls ()
+{
+  const int WALLS = 5000, QUERIES = 20000;
+  unsigned seed = 11;
+  auto random = [&seed](float low, float high) {
+    seed = seed*1103515245 + 12345;
+    return low + (high-low)*((seed >> 8)/16777216.0f);
+  };
+  walls.Walls.clear();
+  for(int i=0; i<WALLS; i++)
   {
-    initial_velocity2 *= -1*0.8;
-    horizontal_translation1 = 1.3;
+    glm::vec2 centre(random(-40, 40), random(-40, 40)), half(random(0.02, 0.3), random(0.02, 0.8));
+    Box bounds = { centre - half, centre + half };
+    walls.Walls.push_back(bounds);
   }
-  if(vertical_translation<-1.6 && (horizontal_translation>0.5 && horizontal_translation<1.1))
+  buildWallGrid();
+
+  int mismatched = 0;
+  double gridTime = 0, everyTime = 0;
+  for(int q=0; q<QUERIES; q++)
   {
-    time_travel = 0;
-    // cout<<initial_velocity1<<" "<<final_velocity1<<endl;
-    initial_velocity1 *= coefficient_of_elasticity;
-    vertical_translation = -1.7;
-    if(initial_velocity1<0)
+    glm::vec2 from(random(-40, 40), random(-40, 40)), to = from + glm::vec2(random(-0.6, 0.6), random(-0.6, 0.6));
+    float radius = random(0.05, 0.2);
+    glm::vec2 normal, side;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    float first = firstWallHit(from, to, radius, normal);
+    chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+    float every = -1;
+    bool sameSide = false;  // a wall touched first on the side the grid found
+    for(size_t i=0; i<walls.Walls.size(); i++)
     {
-      initial_velocity1 *= -1;
+      float t = sweptCircleBox(from, to, radius, walls.Walls[i], side);
+      if(t < 0 || (every >= 0 && t > every))
+        continue;
+      sameSide = (t == every && sameSide) || side == normal;
+      every = t;
     }
+    gridTime += chrono::duration<double, micro>(middle - start).count();
+    everyTime += chrono::duration<double, micro>(chrono::steady_clock::now() - middle).count();
+    if(first != every || (first >= 0 && !sameSide))
+      mismatched++;
   }
-  br[0]=horizontal_translation;
-  br[1]=vertical_translation;
-  br[2]=horizontal_translation1;
-  br[3]=vertical_translation1;
-  br[4]=initial_velocity;
-  br[5]=initial_velocity1;
-  br[6]=initial_velocity2;
-  br[7]=initial_velocity3;
-  br[8]=time_travel;
-  br[9]=time_travel1;
+  printf("Walls: %d walls in a %dx%d grid, %d queries: %.3f us each through the grid, %.3f us testing every wall\n",
+         WALLS, walls.Columns, walls.Rows, QUERIES, gridTime/QUERIES, everyTime/QUERIES);
+  if(mismatched > 0)
+    cerr << "Error: " << mismatched << " of " << QUERIES << " queries found another wall through the grid" << endl;
+  createWalls();
+  return mismatched == 0;
+}
+
+// Where the bird's way this tick first comes within reach of a pig at (x, y),
+// as a fraction of it, or -1. A bird at rest is where it is
+const float PIG_REACH = 0.4; // bird to pig centres for a hit
+float birdHitsPig (float x, float y)
+{
+  glm::vec2 bird(horizontal_translation, vertical_translation), pig(x, y);
+  glm::vec2 from = shoot ? glm::vec2(simulation.Previous[0][0], simulation.Previous[0][1]) : bird;
+  if(from == bird)
+    return glm::length(bird - pig) <= PIG_REACH ? 0 : -1;
+  return sweptCircleCircle(from, bird, pig, PIG_REACH);
 }
 
-void drawCircle(VAO* obj,float horizontal_translation,float vertical_translation)
+// Puts the bird back to that fraction of its way this tick
+void rewindBird (float t)
 {
- for(int i=0;i<360;i++)
+  horizontal_translation = glm::mix(simulation.Previous[0][0], horizontal_translation, t);
+  vertical_translation = glm::mix(simulation.Previous[0][1], vertical_translation, t);
+}
+
+/* Disc meshes, keyed by radius, segment count and (baked in) color */
+map< array<GLfloat,5>, VAO* > circleMeshes;
+
+/* Segments needed so the rim is never more than half a pixel inside the true circle,
+   rounded up to a power of two so the cache only holds a few sizes */
+int circleSegments (float radius)
+{
+  float pixels = radius * viewport_height / zoomY; // ortho: zoomY world units span the viewport
+  int segments = 8;
+  if (pixels > 0.5f)
   {
-  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-  glm::mat4 MVP;  // MVP = Projection * View * Model
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateTriangle = glm::translate (glm::vec3(horizontal_translation,vertical_translation, 0.0f)); // glTranslatef
-  glm::mat4 rotateTriangle = glm::rotate((float)(i*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
-  glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
-  Matrices.model *= triangleTransform; 
-  MVP = VP * Matrices.model; // MVP = p * V * M
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(obj);  
+    float needed = M_PI / acos(1 - 0.5f/pixels);
+    while (segments < needed && segments < 256)
+      segments *= 2;
+  }
+  return segments;
+}
+
+VAO* circleMesh (const Circle& circle, int segments)
+{
+  array<GLfloat,5> key = {{ circle.Radius, (GLfloat)segments, circle.Color[0], circle.Color[1], circle.Color[2] }};
+  map< array<GLfloat,5>, VAO* >::iterator cached = circleMeshes.find(key);
+  if (cached != circleMeshes.end())
+    return cached->second;
+
+  // Triangle fan: the centre, then the rim, closed by repeating the first rim vertex
+  vector<GLfloat> vertex_buffer_data(3*(segments+2), 0);
+  for (int i=0; i<=segments; i++)
+  {
+    vertex_buffer_data[3*(i+1)] = circle.Radius*cos(2*M_PI*i/segments);
+    vertex_buffer_data[3*(i+1)+1] = circle.Radius*sin(2*M_PI*i/segments);
+  }
+  VAO* mesh = create3DObject(GL_TRIANGLE_FAN, segments+2, &vertex_buffer_data[0], circle.Color[0], circle.Color[1], circle.Color[2], GL_FILL);
+  circleMeshes[key] = mesh;
+  return mesh;
+}
+
+/* The same disc as a plain triangle list, for streaming; shares circleMesh's key */
+map< array<GLfloat,5>, DynamicMesh > circleTriangleLists;
+
+const DynamicMesh& circleTriangles (const Circle& circle, int segments)
+{
+  array<GLfloat,5> key = {{ circle.Radius, (GLfloat)segments, circle.Color[0], circle.Color[1], circle.Color[2] }};
+  map< array<GLfloat,5>, DynamicMesh >::iterator cached = circleTriangleLists.find(key);
+  if (cached != circleTriangleLists.end())
+    return cached->second;
+
+  DynamicMesh& mesh = circleTriangleLists[key];
+  for (int i=0; i<segments; i++)
+  {
+    GLfloat triangle_data [] = {
+      0, 0, 0,
+      (GLfloat)(circle.Radius*cos(2*M_PI*i/segments)), (GLfloat)(circle.Radius*sin(2*M_PI*i/segments)), 0,
+      (GLfloat)(circle.Radius*cos(2*M_PI*(i+1)/segments)), (GLfloat)(circle.Radius*sin(2*M_PI*(i+1)/segments)), 0,
+    };
+    mesh.Positions.insert(mesh.Positions.end(), triangle_data, triangle_data + 9);
+    for (int v=0; v<3; v++)
+      mesh.Colors.insert(mesh.Colors.end(), circle.Color, circle.Color + 3);
+  }
+  return mesh;
+}
+
+void drawCircle(const Circle& obj,float horizontal_translation,float vertical_translation,int layer=LAYER_SCENE)
+{
+  Matrices.model = glm::translate (glm::vec3(horizontal_translation,vertical_translation, 0.0f)); // glTranslatef
+  submitDraw(circleMesh(obj, circleSegments(obj.Radius)), Matrices.model, layer);
+}
+
+// For discs that move every frame (projectiles, eyes): appended to the frame's
+// stream batch, so all of them in a layer cost a single draw
+void drawMovingCircle(const Circle& obj,float horizontal_translation,float vertical_translation,int layer=LAYER_SCENE)
+{
+  Matrices.model = glm::translate (glm::vec3(horizontal_translation,vertical_translation, 0.0f)); // glTranslatef
+  submitDynamic(circleTriangles(obj, circleSegments(obj.Radius)), Matrices.model, layer);
+}
+
+/* A flight under the game's gravity, in closed form. Each tick it moves Step,
+   less Fall*Fall downwards, and Fall grows by Rate; so after n ticks it has
+   fallen n F^2 + F R n(n-1) + R^2 (n-1)n(2n-1)/6. That holds for fractional
+   n too, so where it is, and when it comes down through a height, are exact
+   rather than found a tick late by stepping */
+struct Trajectory {
+  glm::vec2 Origin;   // x, y at tick 0
+  glm::vec2 Step;     // a tick's move, before gravity
+  float Fall, Rate;
+};
+
+glm::vec2 trajectoryAt (const Trajectory& arc, float ticks)
+{
+  double n = ticks, F = arc.Fall, R = arc.Rate;
+  double fallen = n*F*F + F*R*n*(n-1) + R*R*(n-1)*n*(2*n-1)/6;
+  return glm::vec2(arc.Origin.x + n*arc.Step.x, arc.Origin.y + n*arc.Step.y - fallen);
+}
+
+// When, in ticks from 0, it comes down through height; -1 if it never does
+float trajectoryLanding (const Trajectory& arc, float height)
+{
+  // Height above the mark as a cubic in n, falling from its apex on
+  double F = arc.Fall, R = arc.Rate;
+  double c0 = arc.Origin.y - height, c1 = arc.Step.y - F*F + F*R - R*R/6, c2 = R*R/2 - F*R, c3 = -R*R/3;
+  double apex = 0;
+  if(c3 < 0)
+  {
+    double d = c2*c2 - 3*c3*c1;
+    if(d > 0)
+      apex = max(0.0, (-c2 - sqrt(d))/(3*c3));
+  }
+  else if(c1 >= 0)
+    return -1;
+  #define ABOVE(n) (c0 + (n)*(c1 + (n)*(c2 + (n)*c3)))
+  if(ABOVE(apex) < 0)
+    return -1;
+  double low = apex, high = apex + 1;
+  while(ABOVE(high) > 0)
+    high = apex + 2*(high - apex);
+  for(int i=0; i<60; i++)
+  {
+    double middle = (low + high)/2;
+    if(ABOVE(middle) > 0)
+      low = middle;
+    else
+      high = middle;
   }
+  #undef ABOVE
+  return high;
 }
 
-void bullet(VAO *obj,float horizontal_translation,float vertical_translation,float time_travel,float angle_thrown,int flagg,float initial_velocity,float initial_velocity1,float final_velocity,float final_velocity1)
+/* The arc a projectile is on since it was last launched, bounced or hit, and
+   where the last tick left it. A tick carries on along the arc, unless
+   something else has moved the projectile since; Ticks is 0 to start over */
+struct Flight {
+  Trajectory Arc;
+  int Ticks;
+  glm::vec2 Position;
+  float Fall;
+} flights[3]; // the bird and the two pigs
+
+glm::vec2 followFlight (Flight& flight, const Trajectory& now)
+{
+  if(flight.Ticks == 0 || flight.Position != now.Origin || flight.Fall != now.Fall || flight.Arc.Step != now.Step)
+  {
+    flight.Arc = now;
+    flight.Ticks = 0;
+  }
+  return trajectoryAt(flight.Arc, ++flight.Ticks);
+}
+
+// Where it is on the way out of a tick, for the next one to check
+void leaveFlight (Flight& flight, float x, float y, float fall)
+{
+  flight.Position = glm::vec2(x, y);
+  flight.Fall = fall;
+}
+
+// The tick's x when the arc came down through height during it, else x
+float landingX (const Flight& flight, float height, float x)
+{
+  float landing = trajectoryLanding(flight.Arc, height);
+  return landing > flight.Ticks-1 && landing <= flight.Ticks ? trajectoryAt(flight.Arc, landing).x : x;
+}
+
+void bullet(float horizontal_translation,float vertical_translation,float time_travel,float angle_thrown,int flagg,float initial_velocity,float initial_velocity1,float final_velocity,float final_velocity1,Flight& flight)
 {
   // cout << initial_velocity << " " << initial_velocity1 << endl;
-  // 
-  drawCircle(obj,horizontal_translation,vertical_translation);
-  horizontal_translation += initial_velocity*cos(angle_thrown)*0.009;
-  vertical_translation += initial_velocity1*sin(angle_thrown)*0.005 - (time_travel*time_travel);
+  Trajectory arc = { glm::vec2(horizontal_translation, vertical_translation), glm::vec2(initial_velocity*cos(angle_thrown)*0.009, initial_velocity1*sin(angle_thrown)*0.005), time_travel, 0.01 };
+  glm::vec2 position = followFlight(flight, arc);
+  horizontal_translation = position.x;
+  vertical_translation = position.y;
   final_velocity = sqrt(sqr(initial_velocity) - ((horizontal_translation+3)*8*0.001));
   final_velocity1 = initial_velocity1 - time_travel*89;
   // cout << final_velocity1 << " " << initial_velocity1 << " " <<  vertical_translation << endl;
   if(vertical_translation<-3.7)
   {
+    // bounce where the arc meets the ground, not a tick's travel past it
+    horizontal_translation = landingX(flight, -3.7, horizontal_translation);
+    flight.Ticks = 0;
     time_travel = 0;
     // cout<<initial_velocity1<<" "<<final_velocity1<<endl;
     if(flagg==1)
@@ -683,9 +1675,12 @@ void bullet(VAO *obj,float horizontal_translation,float vertical_translation,flo
   {
     initial_velocity *= -1;
     horizontal_translation = 3.7;
+    flight.Ticks = 0;
   }
   if(flagg==1 || final_velocity>2 || final_velocity1<-2)
     time_travel += 0.01;
+  else
+    flight.Ticks = 0;
   // cout<< time_travel << endl;
   if((horizontal_translation>4 || horizontal_translation<-4) && (flagg==1))
   {
@@ -694,6 +1689,7 @@ void bullet(VAO *obj,float horizontal_translation,float vertical_translation,flo
     vertical_translation = -2  - 0.65*sin(angle_thrown);
     time_travel = 0;
   }
+  leaveFlight(flight, horizontal_translation, vertical_translation, time_travel);
   ar[0]=horizontal_translation;
   ar[1]=vertical_translation;
   ar[2]=time_travel;
@@ -704,11 +1700,12 @@ void bullet(VAO *obj,float horizontal_translation,float vertical_translation,flo
   ar[7]=final_velocity1;
 }
 
-void specialbullet(VAO *obj,float horizontal_translation,float vertical_translation,float time_travel,float angle_thrown,int flagg,float initial_velocity,float initial_velocity1,float final_velocity,float final_velocity1,int iscollide,int flagfly)
+void specialbullet(float horizontal_translation,float vertical_translation,float time_travel,float angle_thrown,int flagg,float initial_velocity,float initial_velocity1,float final_velocity,float final_velocity1,int iscollide,int flagfly,Flight& flight)
 {
-  drawCircle(obj,horizontal_translation,vertical_translation);
-  horizontal_translation += initial_velocity*cos(angle_thrown)*0.005;
-  vertical_translation += initial_velocity1*sin(angle_thrown)*0.005 - (time_travel*time_travel);
+  Trajectory arc = { glm::vec2(horizontal_translation, vertical_translation), glm::vec2(initial_velocity*cos(angle_thrown)*0.005, initial_velocity1*sin(angle_thrown)*0.005), time_travel, 0.01 };
+  glm::vec2 position = followFlight(flight, arc);
+  horizontal_translation = position.x;
+  vertical_translation = position.y;
   // cout << vertical_translation << " " << time_travel<< endl;
   final_velocity1 = initial_velocity1 - time_travel*89;
   final_velocity = sqrt(sqr(initial_velocity) - ((horizontal_translation+3)*8*0.001));
@@ -716,10 +1713,13 @@ void specialbullet(VAO *obj,float horizontal_translation,float vertical_translat
   {
     initial_velocity *= -1;
     horizontal_translation = 3.6 ;
+    flight.Ticks = 0;
     // cout << "???????" << endl;
   }
   if(vertical_translation<-3.6)
   {
+    horizontal_translation = landingX(flight, -3.6, horizontal_translation);
+    flight.Ticks = 0;
     time_travel = 0;
     initial_velocity1 = -final_velocity1*coefficient_of_elasticity;
     initial_velocity1 *=0.8;
@@ -734,6 +1734,9 @@ void specialbullet(VAO *obj,float horizontal_translation,float vertical_translat
     // cout << iscollide <<"$$$$$$$$$" << flagfly <<  endl;
     time_travel+=0.01;
   }
+  else
+    flight.Ticks = 0;
+  leaveFlight(flight, horizontal_translation, vertical_translation, time_travel);
   forerror=time_travel;
   // cout << initial_velocity <<  " " << angle_thrown << " " << horizontal_translation <<  endl;
   br[0]=horizontal_translation;
@@ -746,32 +1749,13 @@ void specialbullet(VAO *obj,float horizontal_translation,float vertical_translat
   // cout << " )))) " << br[2] << endl;
 }
 
-void draw ()
+/* One tick of the game: the bird, the pigs, and what they hit */
+void tick ()
 {
-  
-  array_postion = 0;
-  // cout << horizontal_translation1 << " " << vertical_translation1 << endl;
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
-Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0f, 0.1f, 500.0f);
-  // Eye - Location of camera. Don't change unless you are sure!!
-  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  glm::vec3 target (0, 0, 0);
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  glm::vec3 up (0, 1, 0);
-
-  // Compute Camera matrix (view)
-  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-  //  Don't change unless you are sure!!
-  // drawCircle(triangle,horizontal_translation1,vertical_translation1);
-    drawCircle(tankercircle,-3,-2.6);
+  keepPreviousState();
   if(shoot==1)
   {
-    bullet(triangle,horizontal_translation,vertical_translation,time_travel,angle_thrown,1,initial_velocity,initial_velocity1,final_velocity,final_velocity1);
+    bullet(horizontal_translation,vertical_translation,time_travel,angle_thrown,1,initial_velocity,initial_velocity1,final_velocity,final_velocity1,flights[0]);
     horizontal_translation=ar[0];
     vertical_translation=ar[1];
     time_travel=ar[2];
@@ -782,8 +1766,9 @@ Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0
     final_velocity1=ar[7];
     // initial_velocity = 40*cos(angle_thrown);
     // initial_velocity1 = 40*sin(angle_thrown);
+    if(shoot==1)
+      bounceOffWalls(glm::vec2(simulation.Previous[0][0], simulation.Previous[0][1]), triangle.Radius, horizontal_translation, vertical_translation, initial_velocity, initial_velocity1, time_travel);
   }
-  
   if(iscollide==1)
   {
     flagfly = 1;
@@ -800,28 +1785,12 @@ Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0
     flagfly1 = 1;
     timetonextcollide++;
   }  
-  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane 
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-  glm::mat4 MVP;  // MVP = Projection * View * Model
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(-3, -2, 0));        // glTranslatef
-  glm::mat4 translateRectangle1 = glm::translate (glm::vec3(0, -0.6, 0)); 
-  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(0, 0.6, 0)); 
-  glm::mat4 rotateRectangle = glm::rotate((float)(-90+ tanker_angle), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  // translateRectangle = glm::translate (glm::vec3(-3, -2, 0));        // glTranslatef
-  Matrices.model *= (translateRectangle * translateRectangle1 * rotateRectangle * translateRectangle2); 
-  MVP = VP * Matrices.model; // MVP = p * V * M
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle);
   // cout << horizontal_translation2 << " " << vertical_translation2 << " " << time_travel2<< endl;
-  object_collision = sqrt(sqr(horizontal_translation- horizontal_translation1)+ sqr(vertical_translation- vertical_translation1));
-  if(noofcollisions>2)
-  {
-    object_collision=100;
-  }
+  object_collision = noofcollisions>2 ? -1 : birdHitsPig(horizontal_translation1, vertical_translation1);
   // cout << object_collision << " &"<< endl;
-  if(object_collision<=0.4 && iscollide==0)
+  if(object_collision>=0 && iscollide==0)
   {
+    rewindBird(object_collision);
     initial_velocity2 = (2*initial_velocity)/3.5;
     initial_velocity3 = (2*initial_velocity1)/3.5;
     // cout << initial_velocity << " " << initial_velocity1 << " " << final_velocity << " " << final_velocity1 << endl;
@@ -851,16 +1820,10 @@ Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0
     // horizontal_translation -=0.4;
   }
 
-  // Increment angles
-  // wall_collision(1,-3.2,rectangle);
-  // wall_collision(0.8,-3.2,rectangle);
-  // wall_collision(0.6,-3.2,rectangle);
-  if(shoot==1)
-    drawCircle(triangle,horizontal_translation,vertical_translation);
   // cout << horizontal_translation1 << vertical_translation1 << time_travel1 << angle_thrown1 << endl;
   if(noofcollisions<=2)
   {
-    specialbullet(triangle1,horizontal_translation1,vertical_translation1,time_travel1,angle_thrown1,0,initial_velocity2,initial_velocity3,final_velocity2,final_velocity3,iscollide,flagfly);
+    specialbullet(horizontal_translation1,vertical_translation1,time_travel1,angle_thrown1,0,initial_velocity2,initial_velocity3,final_velocity2,final_velocity3,iscollide,flagfly,flights[1]);
     horizontal_translation1=br[0];
     vertical_translation1=br[1];
     time_travel1=br[2];
@@ -869,44 +1832,9 @@ Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0
     initial_velocity3=br[5];
     final_velocity2=br[6];
     final_velocity3=br[7];
+    bounceOffWalls(glm::vec2(simulation.Previous[1][0], simulation.Previous[1][1]), triangle1.Radius, horizontal_translation1, vertical_translation1, initial_velocity2, initial_velocity3, time_travel1);
 }
 
-  for(int iiii=0;iiii<10;iiii++)
-  {
-    drawing_walls(0.6,-3.8+0.2*iiii,powerboxes);
-    drawing_walls(0.8,-3.8+0.2*iiii,powerboxes);
-    drawing_walls(1,-3.8+0.2*iiii,powerboxes);
-  }
-  // wall_collision(1,0);
-  bird_collision(horizontal_translation,vertical_translation,horizontal_translation1,vertical_translation1,initial_velocity,initial_velocity1,initial_velocity2,initial_velocity3,time_travel,time_travel1);
-  horizontal_translation=br[0];
-  vertical_translation=br[1];
-  horizontal_translation1=br[2];
-  vertical_translation1=br[3];
-  initial_velocity=br[4];
-  initial_velocity1=br[5];
-  initial_velocity2=br[6];
-  initial_velocity3=br[7];
-  time_travel=br[8];
-  time_travel1=br[9];
-
-  for(int iiii=0;iiii<40;iiii++)
-  {  
-    drawing_walls(3.9,3.9-iiii*0.2,powerboxes);
-  }
-  int qwerty=distance3+2+power1;
-  for(int iiii=0;iiii<(qwerty);iiii++)
-  {
-    drawing_walls(-3.8+0.3*iiii,3.7,powerboxes);
-  }
-  // for(int iiii=0;iiii<6;iiii++)
-  // {
-  //   drawing_walls(-1.4+0.2*iiii,2,powerboxes);
-  // }
-  for(int iiii=0;iiii<39;iiii++)
-  {
-    drawing_walls(-3.9+0.2*iiii,-3.9,powerboxes);
-  }
 
 //////////////////////////////////////////
 // object_collision1 = sqrt(sqr(horizontal_translation- horizontal_translation2)+ sqr(vertical_translation- vertical_translation2));
@@ -934,14 +1862,11 @@ Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0
   // cout << time_travel2 << "&&&&" << br[2] << endl;
 ////////////////////////////////
 
-object_collision1 = sqrt(sqr(horizontal_translation- horizontal_translation2)+ sqr(vertical_translation- vertical_translation2));
-if(noofcollisions1>2)
-{
-  object_collision1=100;
-}
+object_collision1 = noofcollisions1>2 ? -1 : birdHitsPig(horizontal_translation2, vertical_translation2);
 
-if(object_collision1<=0.4 && iscollide1==0)
+if(object_collision1>=0 && iscollide1==0)
   {
+    rewindBird(object_collision1);
     initial_velocity4 = (2*initial_velocity)/3.5;
     initial_velocity5 = (2*initial_velocity1)/3.5;
     initial_velocity = -(initial_velocity)/1.5;
@@ -964,7 +1889,7 @@ if(object_collision1<=0.4 && iscollide1==0)
   // cout << "UUUUUUUU" << endl;
 if(noofcollisions1<=2)
 {
-    specialbullet(triangle1,horizontal_translation2,vertical_translation2,time_travel2,angle_thrown2,0,initial_velocity4,initial_velocity5,final_velocity4,final_velocity5,iscollide1,flagfly1);
+    specialbullet(horizontal_translation2,vertical_translation2,time_travel2,angle_thrown2,0,initial_velocity4,initial_velocity5,final_velocity4,final_velocity5,iscollide1,flagfly1,flights[2]);
     horizontal_translation2=br[0];
     vertical_translation2=br[1];
     time_travel2=br[2];
@@ -975,58 +1900,121 @@ if(noofcollisions1<=2)
     initial_velocity5=br[5];
     final_velocity4=br[6];
     final_velocity5=br[7];
+    bounceOffWalls(glm::vec2(simulation.Previous[2][0], simulation.Previous[2][1]), triangle1.Radius, horizontal_translation2, vertical_translation2, initial_velocity4, initial_velocity5, time_travel2);
 }
 // time_travel2=forerror;
 
-bird_collision(horizontal_translation,vertical_translation,horizontal_translation2,vertical_translation2,initial_velocity,initial_velocity1,initial_velocity4,initial_velocity5,time_travel,time_travel2);
-  horizontal_translation=br[0];
-  vertical_translation=br[1];
-  horizontal_translation2=br[2];
-  vertical_translation2=br[3];
-  initial_velocity=br[4];
-  initial_velocity1=br[5];
-  initial_velocity4=br[6];
-  initial_velocity5=br[7];
-  time_travel=br[8];
-  time_travel2=br[9];
-
 // cout << initial_velocity4 << " " <<  initial_velocity5 <<  " " << object_collision1 << " " << time_travel2 <<  endl;
 /////////////////////////////////////////
+}
+
+// The scene, alpha of the way from before the last tick to now
+void draw (float alpha)
+{
+
+  // cout << horizontal_translation1 << " " << vertical_translation1 << endl;
+  // clear the color and depth in the frame buffer
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  // use the loaded shader program
+  // Don't change unless you know what you are doing
+  stateUseProgram (programID);
+Matrices.projection = glm::ortho(-zoomX/2.0f, zoomX/2.0f, -zoomY/2.0f, zoomY/2.0f, 0.1f, 500.0f);
+  // Eye - Location of camera. Don't change unless you are sure!!
+  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
+  // Target - Where is the camera looking at.  Don't change unless you are sure!!
+  glm::vec3 target (0, 0, 0);
+  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+  glm::vec3 up (0, 1, 0);
+
+  // Compute Camera matrix (view)
+  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+  //  Don't change unless you are sure!!
+  // Once per frame: every object shares it through the camera uniform block
+  Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+  // drawCircle(triangle,horizontal_translation1,vertical_translation1);
+    drawCircle(tankercircle,-3,-2.6,LAYER_TANK);
+  
+  Matrices.model = glm::mat4(1.0f);
+  glm::mat4 translateRectangle = glm::translate (glm::vec3(-3, -2, 0));        // glTranslatef
+  glm::mat4 translateRectangle1 = glm::translate (glm::vec3(0, -0.6, 0)); 
+  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(0, 0.6, 0)); 
+  glm::mat4 rotateRectangle = glm::rotate((float)(-90+ tanker_angle), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
+  // translateRectangle = glm::translate (glm::vec3(-3, -2, 0));        // glTranslatef
+  Matrices.model *= (translateRectangle * translateRectangle1 * rotateRectangle * translateRectangle2); 
+  submitDraw(rectangle, Matrices.model, LAYER_TANK);
+  // Increment angles
+  // Where the bird and the pigs are this frame, between the last two ticks
+  float moving[3][2] = { {horizontal_translation,vertical_translation}, {horizontal_translation1,vertical_translation1}, {horizontal_translation2,vertical_translation2} };
+  for(int i=0;i<3;i++)
+    for(int j=0;j<2;j++)
+      moving[i][j] = glm::mix(simulation.Previous[i][j], moving[i][j], alpha);
+  if(shoot==1)
+    drawMovingCircle(triangle,moving[0][0],moving[0][1],LAYER_BIRDS);
+  if(noofcollisions<=2)
+    drawMovingCircle(triangle1,moving[1][0],moving[1][1],LAYER_BIRDS);
+  if(noofcollisions1<=2)
+    drawMovingCircle(triangle1,moving[2][0],moving[2][1],LAYER_BIRDS);
 
+  for(int iiii=0;iiii<10;iiii++)
+  {
+    drawing_walls(0.6,-3.8+0.2*iiii,powerboxes);
+    drawing_walls(0.8,-3.8+0.2*iiii,powerboxes);
+    drawing_walls(1,-3.8+0.2*iiii,powerboxes);
+  }
 
+  for(int iiii=0;iiii<40;iiii++)
+  {  
+    drawing_walls(3.9,3.9-iiii*0.2,powerboxes);
+  }
+  int qwerty=distance3+2+power1;
+  for(int iiii=0;iiii<(qwerty);iiii++)
+  {
+    drawing_walls(-3.8+0.3*iiii,3.7,powerboxes);
+  }
+  // for(int iiii=0;iiii<6;iiii++)
+  // {
+  //   drawing_walls(-1.4+0.2*iiii,2,powerboxes);
+  // }
+  for(int iiii=0;iiii<39;iiii++)
+  {
+    drawing_walls(-3.9+0.2*iiii,-3.9,powerboxes);
+  }
 
 ///////////////////////////score
   for(int iiii=0;(iiii<6) && (score==0 || score==1 || score==2 || score==3 || score==7 || score==8 || score==9 || score==4);iiii++)
-    drawing_walls(3,3.6-0.12*iiii,scoresource);
+    drawing_walls(3,3.6-0.12*iiii,scoresource,LAYER_SCORE);
 
   for(int iiii=0;(iiii<6) && (score==0 || score==1 || score==3 || score==4 || score==5 || score==6 || score==7 || score==8 || score==9);iiii++)
-      drawing_walls(3,2.87-0.12*iiii,scoresource);
+      drawing_walls(3,2.87-0.12*iiii,scoresource,LAYER_SCORE);
 
   for(int iiii=0;(iiii<6) && (score==0 || score==4 || score==5 || score==6 || score==8 || score==9);iiii++)
-    drawing_walls(2.28,3.6-0.12*iiii,scoresource);
+    drawing_walls(2.28,3.6-0.12*iiii,scoresource,LAYER_SCORE);
 
   for(int iiii=0;(iiii<7) && (score==0 || score==2 || score==6 || score==8);iiii++)
-    drawing_walls(2.28,2.87-0.12*iiii,scoresource);
+    drawing_walls(2.28,2.87-0.12*iiii,scoresource,LAYER_SCORE);
 
   for(int iiii=0;(iiii<7) && (score==0 || score==2 || score==3 || score==5 || score==6 || score==7 || score==8 || score==9);iiii++)
-    drawing_walls(3-0.12*iiii,3.6,scoresource);
+    drawing_walls(3-0.12*iiii,3.6,scoresource,LAYER_SCORE);
 
   for(int iiii=0;(iiii<7) && (score==0 || score==2 || score==3 || score==5 || score==6 || score==8);iiii++)
-    drawing_walls(3-0.12*iiii,2.15,scoresource);
+    drawing_walls(3-0.12*iiii,2.15,scoresource,LAYER_SCORE);
 
   for(int iiii=0;(iiii<7) && (score==2 || score==3 || score==4 || score==5 || score==6 || score==8 || score==9);iiii++)
-    drawing_walls(3-0.12*iiii,2.90,scoresource);
+    drawing_walls(3-0.12*iiii,2.90,scoresource,LAYER_SCORE);
 //////////////////////
   if(noofcollisions==1 || noofcollisions==0 || noofcollisions==2)
-    drawCircle(pig,horizontal_translation1+0.12*cos(M_PI/4),vertical_translation1+0.12*sin(M_PI/4));
+    drawMovingCircle(pig,moving[1][0]+0.12*cos(M_PI/4),moving[1][1]+0.12*sin(M_PI/4),LAYER_EYES);
   if(noofcollisions==0 || noofcollisions==1)
-    drawCircle(pig,horizontal_translation1+0.12*cos((3*M_PI)/4),vertical_translation1+0.12*sin((3*M_PI)/4));
+    drawMovingCircle(pig,moving[1][0]+0.12*cos((3*M_PI)/4),moving[1][1]+0.12*sin((3*M_PI)/4),LAYER_EYES);
   if(noofcollisions1==1 || noofcollisions1==0 || noofcollisions1==2)
-    drawCircle(pig,horizontal_translation2+0.12*cos(M_PI/4),vertical_translation2+0.12*sin(M_PI/4));
+    drawMovingCircle(pig,moving[2][0]+0.12*cos(M_PI/4),moving[2][1]+0.12*sin(M_PI/4),LAYER_EYES);
   if(noofcollisions1==0 || noofcollisions1==1)
-    drawCircle(pig,horizontal_translation2+0.12*cos((3*M_PI)/4),vertical_translation2+0.12*sin((3*M_PI)/4));
+    drawMovingCircle(pig,moving[2][0]+0.12*cos((3*M_PI)/4),moving[2][1]+0.12*sin((3*M_PI)/4),LAYER_EYES);
   // cout << iscollide << " " << flagfly << endl;
   // cout << initial_velocity2 << " "  << initial_velocity3 << endl;
+
+  // Everything submitted above is sorted and drawn here
+  flushRenderQueue();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1054,7 +2042,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    glfwSwapInterval( simulation.Vsync ? 1 : 0 );
 
     /* --- register callbacks with GLFW --- */
 
@@ -1086,20 +2074,22 @@ void initGL (GLFWwindow* window, int width, int height)
   scorerectangle();
   createtankercircle();
   createpig();
+  createWalls();
   // Create and compile our GLSL program from the shaders
   programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-  // Get a handle for our "MVP" uniform
-  Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+  // Get a handle for our "Model" uniform; the camera goes in a shared uniform block
+  Matrices.ModelID = glGetUniformLocation(programID, "Model");
+  createCameraBlock(vector<GLuint>(1, programID));
 
   
   reshapeWindow (window, width, height);
 
     // Background color of the scene
-  glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
-  glClearDepth (1.0f);
+  stateClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
+  stateClearDepth (1.0f);
 
-  glEnable (GL_DEPTH_TEST);
-  glDepthFunc (GL_LEQUAL);
+  stateEnable (GL_DEPTH_TEST);
+  stateDepthFunc (GL_LEQUAL);
 
     cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
@@ -1107,50 +2097,202 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* Headless mode (--headless <frames> [--dump <prefix>]): no window, an EGL
+   surfaceless context (Mesa llvmpipe is enough) rendering into an offscreen
+   framebuffer, as fast as it can, for a fixed number of frames */
+struct Headless {
+    bool Enabled;
+    int Frames;
+    string DumpPrefix;       // when set, frame i is written to <prefix>NNNN.ppm
+#ifdef HEADLESS_EGL
+    EGLDisplay Display;
+    EGLContext Context;
+#endif
+    GLuint Framebuffer;
+    GLuint Renderbuffers[2]; // color, depth
+} headless;
+
+void usage (const char* program)
+{
+    cerr << "usage: " << program << " [--tick-rate <hz>] [--no-vsync] [--headless <frames> [--dump <prefix>]]" << endl;
+    cerr << "       " << program << " --check-walls" << endl;
+    exit(EXIT_FAILURE);
+}
+
+void parseArguments (int argc, char** argv)
+{
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        if (arg == "--headless" && i+1 < argc) {
+            headless.Enabled = true;
+            headless.Frames = atoi(argv[++i]);
+        }
+        else if (arg == "--dump" && i+1 < argc)
+            headless.DumpPrefix = argv[++i];
+        else if (arg == "--tick-rate" && i+1 < argc)
+            simulation.TickRate = max(1.0, atof(argv[++i]));
+        else if (arg == "--no-vsync")
+            simulation.Vsync = false;
+        else if (arg == "--check-walls")
+            exit(checkWalls() ? EXIT_SUCCESS : EXIT_FAILURE);
+        else
+            usage(argv[0]);
+    }
+    if (!headless.DumpPrefix.empty() && !headless.Enabled)
+        usage(argv[0]); // frames are only dumped when rendered offscreen
+}
+
+void initHeadless (int width, int height)
+{
+#ifdef HEADLESS_EGL
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    headless.Display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (headless.Display == EGL_NO_DISPLAY || !eglInitialize(headless.Display, NULL, NULL)) {
+        cerr << "Error: no EGL display for headless rendering" << endl;
+        exit(EXIT_FAILURE);
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglChooseConfig(headless.Display, configAttribs, &config, 1, &numConfigs);
+    EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.Context = eglCreateContext(headless.Display, numConfigs ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (headless.Context == EGL_NO_CONTEXT || !eglMakeCurrent(headless.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.Context)) {
+        cerr << "Error: could not create a surfaceless OpenGL 3.3 context" << endl;
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // Stands in for the window's default framebuffer for the whole run
+    glGenFramebuffers(1, &headless.Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+    glGenRenderbuffers(2, headless.Renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.Renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.Renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.Renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.Renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cerr << "Error: offscreen framebuffer is incomplete" << endl;
+        exit(EXIT_FAILURE);
+    }
+#else
+    cerr << "Error: headless mode needs EGL, which this build does not have" << endl;
+    exit(EXIT_FAILURE);
+#endif
+}
+
+/* Write the offscreen color buffer as a binary PPM, top row first */
+void dumpFrame (int frame, int width, int height)
+{
+    vector<GLubyte> pixels(width*height*4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+
+    char name[16];
+    sprintf(name, "%04d.ppm", frame);
+    ofstream file((headless.DumpPrefix + name).c_str(), ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    for (int y=height-1; y>=0; y--)
+        for (int x=0; x<width; x++)
+            file.write((const char*)&pixels[4*(y*width + x)], 3);
+}
+
+// A tick of aiming: the tank follows the cursor, within its limits
+void aimTank ()
+{
+  if(xmousePos<500)
+  {
+    tanker_angle = atan2(500 - ymousePos,xmousePos-70) + M_PI/7 + additional_angle;
+    distance3 = sqr(-3 - ((xmousePos*8)/600)) + sqr(-2 - (((600-ymousePos)*8)/600));
+    // cout << distance3 <<  " " << -3 - ((xmousePos*8)/600) << " " << -2 - ((ymousePos*8)/600) << endl;
+    distance3 -= 40;
+    distance3 /= 15;
+    distance3 = floor(distance3);
+    power = 30+2*distance3+power1;
+    if(tanker_angle>M_PI/1.5)
+    {
+      if(additional_angle>0)
+        additional_angle-=M_PI/18;
+      else
+        tanker_angle = M_PI/1.5;
+
+    }
+    if(tanker_angle<M_PI/6.5)
+    {
+      if(additional_angle<0)
+      {
+        additional_angle+=M_PI/18;
+      }
+      else
+      {
+        tanker_angle = M_PI/6.5;
+      }
+    }
+  }
+}
+
+/* Render headless.Frames frames unthrottled, a tick each, and report what they cost */
+void runHeadless (int width, int height)
+{
+    double total = 0, slowest = 0;
+    for (int frame=0; frame<headless.Frames; frame++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        tick();
+        draw(1);
+        glFinish(); // count the GPU's share of the frame too
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        total += ms;
+        slowest = max(slowest, ms);
+
+        if (!headless.DumpPrefix.empty())
+            dumpFrame(frame, width, height);
+    }
+    if (headless.Frames > 0)
+        printf("Headless: %d frames, %.3f ms/frame average, %.3f ms slowest\n", headless.Frames, total/headless.Frames, slowest);
+}
+
 int main (int argc, char** argv)
 {
   int width = 600;
   int height = 600;
 
+    parseArguments(argc, argv);
+    if (headless.Enabled) {
+        initHeadless(width, height);
+        initGL (NULL, width, height);
+        runHeadless(width, height);
+        printGLStateCounters();
+        printStreamCounters();
+        exit(EXIT_SUCCESS);
+    }
+
     GLFWwindow* window = initGLFW(width, height);
 
   initGL (window, width, height);
 
     double last_update_time = glfwGetTime(), current_time;
+    double last_frame_time = last_update_time, owed = 0;
     while (!glfwWindowShouldClose(window)) {
-
-        // OpenGL Draw commands
-        draw();
+        // The ticks owed since the last frame; after a stall, catch up a quarter second at most
+        current_time = glfwGetTime();
+        owed += min(current_time - last_frame_time, 0.25);
+        last_frame_time = current_time;
         glfwGetCursorPos(window,&xmousePos,&ymousePos);
-        if(xmousePos<500)
-        {
-          tanker_angle = atan2(500 - ymousePos,xmousePos-70) + M_PI/7 + additional_angle;
-          distance3 = sqr(-3 - ((xmousePos*8)/600)) + sqr(-2 - (((600-ymousePos)*8)/600));
-          // cout << distance3 <<  " " << -3 - ((xmousePos*8)/600) << " " << -2 - ((ymousePos*8)/600) << endl;
-          distance3 -= 40;
-          distance3 /= 15;
-          distance3 = floor(distance3);
-          power = 30+2*distance3+power1;
-          if(tanker_angle>M_PI/1.5)
-          {
-            if(additional_angle>0)
-              additional_angle-=M_PI/18;
-            else
-              tanker_angle = M_PI/1.5;
-
-          }
-          if(tanker_angle<M_PI/6.5)
-          {
-            if(additional_angle<0)
-            {
-              additional_angle+=M_PI/18;
-            }
-            else
-            {
-              tanker_angle = M_PI/6.5;
-            }
-          }
+        for (; owed >= 1/simulation.TickRate; owed -= 1/simulation.TickRate) {
+            aimTank();
+            tick();
         }
+
+        // OpenGL Draw commands, between the last tick and the next
+        draw(owed*simulation.TickRate);
         glfwSwapBuffers(window);
         glfwPollEvents();
         current_time = glfwGetTime(); // Time in seconds
@@ -1159,6 +2301,8 @@ int main (int argc, char** argv)
         }
     }
 
+    printGLStateCounters();
+    printStreamCounters();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
\ No newline at end of file
@@ -0,0 +1,26 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+// per-instance data : advances once per instance, not per vertex
+layout (location = 2) in vec3 instanceOffset;
+
+// Projection * View, uploaded once per frame and shared by every program
+layout (std140) uniform Camera {
+    mat4 ViewProjection;
+};
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Every instance is the same mesh, translated by its own offset
+    vec4 v = vec4(vertexPosition + instanceOffset, 1);
+
+    fragColor = vertexColor;
+
+    // No per-object uniform at all: the offset is the whole model transform
+    gl_Position = ViewProjection * v;
+}
@@ -6,6 +6,13 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#ifdef __linux__
+#define HEADLESS_EGL // offscreen rendering through EGL, see initHeadless()
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
@@ -15,6 +22,14 @@
 #include <ao/ao.h>
 #include <mpg123.h>
 #include <thread>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #define ll long long
@@ -32,10 +47,23 @@ struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
     GLuint ColorBuffer;
+    GLuint OffsetBuffer; // per-instance offsets, 0 when not instanced
+    bool SharedBuffers;  // vertex/index buffers belong to another VAO, see createInstancedView()
+
+    GLuint IndexBuffer;  // element buffer, 0 when drawn unindexed
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;
+    GLenum IndexType;    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+
+    // Vertex layout, chosen when the mesh is created
+    int Format;          // one of VertexFormat
+    GLenum PositionType; // GL_FLOAT or GL_HALF_FLOAT
+    GLenum ColorType;    // GL_FLOAT or normalized GL_UNSIGNED_BYTE
+    GLsizei Stride;      // bytes per vertex, 0 for the separate layout
+    int NumInstances;
 };
 typedef struct VAO VAO;
 
@@ -43,10 +71,180 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLint ModelID;        // "Model" uniform of programID
+	GLuint CameraBuffer;  // "Camera" uniform block, shared by all programs
+	glm::mat4 CameraUploaded;
 } Matrices;
 
-GLuint programID;
+const GLuint CAMERA_BINDING = 0; // uniform buffer binding point of the camera block
+
+GLuint programID, instancedProgramID;
+
+/* Shadow copy of the GL state. Every state change goes through the state*
+   functions below, which skip calls that would not change anything. */
+struct GLStateCache {
+    GLuint Program;
+    GLuint VertexArray;
+    GLuint ArrayBuffer, UniformBuffer;
+    GLenum PolygonMode;
+    GLenum DepthFunc;
+    GLfloat ClearColor[4];
+    GLdouble ClearDepth;
+    GLint Viewport[4];
+    map<GLenum, bool> Capabilities;
+    map<GLuint, unsigned> EnabledAttribs;               // per VAO, bit i = attribute i
+    map< pair<GLuint,GLint>, glm::mat4 > MatrixUniforms; // last value per (program, location)
+
+    unsigned long Issued;  // calls that reached the driver
+    unsigned long Skipped; // calls elided as no-ops
+} GLState = { 0, 0, 0, 0, GL_FILL, GL_LESS, {0, 0, 0, 0}, 1.0, {-1, -1, -1, -1} };
+
+/* Returns true (and counts it) when the call has to be issued */
+bool stateChanged (bool changed)
+{
+    if (changed)
+        GLState.Issued++;
+    else
+        GLState.Skipped++;
+    return changed;
+}
+
+void stateUseProgram (GLuint program)
+{
+    if (stateChanged(GLState.Program != program)) {
+        GLState.Program = program;
+        glUseProgram (program);
+    }
+}
+
+void stateBindVertexArray (GLuint vertexArray)
+{
+    if (stateChanged(GLState.VertexArray != vertexArray)) {
+        GLState.VertexArray = vertexArray;
+        glBindVertexArray (vertexArray);
+    }
+}
+
+void stateBindBuffer (GLenum target, GLuint buffer)
+{
+    // The array and uniform buffer bindings are shadowed. The element buffer
+    // is VAO state, and the other targets are not tracked: always issued
+    GLuint* bound = target == GL_ARRAY_BUFFER ? &GLState.ArrayBuffer : target == GL_UNIFORM_BUFFER ? &GLState.UniformBuffer : NULL;
+    if (bound == NULL) {
+        stateChanged(true);
+        glBindBuffer (target, buffer);
+    }
+    else if (stateChanged(*bound != buffer)) {
+        *bound = buffer;
+        glBindBuffer (target, buffer);
+    }
+}
+
+void stateEnableVertexAttribArray (GLuint index)
+{
+    unsigned& enabled = GLState.EnabledAttribs[GLState.VertexArray];
+    if (stateChanged(!(enabled & (1u << index)))) {
+        enabled |= (1u << index);
+        glEnableVertexAttribArray (index);
+    }
+}
+
+void statePolygonMode (GLenum mode)
+{
+    if (stateChanged(GLState.PolygonMode != mode)) {
+        GLState.PolygonMode = mode;
+        glPolygonMode (GL_FRONT_AND_BACK, mode);
+    }
+}
+
+void stateEnable (GLenum capability)
+{
+    bool& enabled = GLState.Capabilities[capability];
+    if (stateChanged(!enabled)) {
+        enabled = true;
+        glEnable (capability);
+    }
+}
+
+void stateDisable (GLenum capability)
+{
+    bool& enabled = GLState.Capabilities[capability];
+    if (stateChanged(enabled)) {
+        enabled = false;
+        glDisable (capability);
+    }
+}
+
+void stateDepthFunc (GLenum func)
+{
+    if (stateChanged(GLState.DepthFunc != func)) {
+        GLState.DepthFunc = func;
+        glDepthFunc (func);
+    }
+}
+
+void stateClearColor (GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
+{
+    GLfloat color[4] = { red, green, blue, alpha };
+    if (stateChanged(memcmp(GLState.ClearColor, color, sizeof(color)) != 0)) {
+        memcpy(GLState.ClearColor, color, sizeof(color));
+        glClearColor (red, green, blue, alpha);
+    }
+}
+
+void stateClearDepth (GLdouble depth)
+{
+    if (stateChanged(GLState.ClearDepth != depth)) {
+        GLState.ClearDepth = depth;
+        glClearDepth (depth);
+    }
+}
+
+void stateViewport (GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    GLint viewport[4] = { x, y, width, height };
+    if (stateChanged(memcmp(GLState.Viewport, viewport, sizeof(viewport)) != 0)) {
+        memcpy(GLState.Viewport, viewport, sizeof(viewport));
+        glViewport (x, y, width, height);
+    }
+}
+
+/* Deleting a bound buffer unbinds it, keep the shadow copy in step */
+void stateDeleteBuffer (GLuint buffer)
+{
+    if (GLState.ArrayBuffer == buffer)
+        GLState.ArrayBuffer = 0;
+    if (GLState.UniformBuffer == buffer)
+        GLState.UniformBuffer = 0;
+    stateChanged(true);
+    glDeleteBuffers(1, &buffer);
+}
+
+void stateDeleteVertexArray (GLuint vertexArray)
+{
+    if (GLState.VertexArray == vertexArray)
+        GLState.VertexArray = 0;
+    GLState.EnabledAttribs.erase(vertexArray); // the name may be handed out again
+    stateChanged(true);
+    glDeleteVertexArrays(1, &vertexArray);
+}
+
+/* Uniform values belong to the program, so the cache is keyed by the bound program */
+void stateUniformMatrix4fv (GLint location, const glm::mat4& matrix)
+{
+    pair<GLuint,GLint> key(GLState.Program, location);
+    map< pair<GLuint,GLint>, glm::mat4 >::iterator cached = GLState.MatrixUniforms.find(key);
+    if (stateChanged(cached == GLState.MatrixUniforms.end() || memcmp(&cached->second[0][0], &matrix[0][0], sizeof(glm::mat4)) != 0)) {
+        GLState.MatrixUniforms[key] = matrix;
+        glUniformMatrix4fv(location, 1, GL_FALSE, &matrix[0][0]);
+    }
+}
+
+void printGLStateCounters ()
+{
+    unsigned long total = GLState.Issued + GLState.Skipped;
+    printf("GL state calls: %lu issued, %lu skipped (%.1f%% elided)\n", GLState.Issued, GLState.Skipped, total ? 100.0*GLState.Skipped/total : 0.0);
+}
 
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
@@ -130,8 +328,14 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+void printStreamCounters (); // with the stream buffer, below
+void printCullingCounters (); // with the world, below
+
 void quit(GLFWwindow *window)
 {
+    printGLStateCounters();
+    printStreamCounters();
+    printCullingCounters();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
@@ -139,22 +343,136 @@ void quit(GLFWwindow *window)
 
 
 
+/* Vertex layouts a mesh can be stored in */
+enum VertexFormat {
+    VERTEX_SEPARATE_FLOAT, // two VBOs, 3 floats per vertex each
+    VERTEX_PACKED_FLOAT,   // one interleaved VBO: float xyz + normalized ubyte rgb (16 bytes)
+    VERTEX_PACKED_HALF,    // one interleaved VBO: half float xyz + normalized ubyte rgb (12 bytes)
+    VERTEX_PACKED_AUTO     // packed half if the positions survive it, packed float otherwise
+};
+
+/* Largest position error (in world units) accepted for half float positions */
+const float HALF_POSITION_TOLERANCE = 1.0f/1024;
+
+/* IEEE 754 binary16 conversion, round to nearest */
+GLushort floatToHalf (float value)
+{
+    GLuint bits;
+    memcpy(&bits, &value, sizeof(bits));
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = bits & 0x7fffff;
+
+    if (exponent <= 0) { // too small for a normal half: subnormal or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        GLuint half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1)
+            half++;
+        return sign | half;
+    }
+    if (exponent >= 31) // overflow, clamp to infinity
+        return sign | 0x7c00;
+
+    GLuint half = (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000) // a carry into the exponent is still correct
+        half++;
+    return sign | half;
+}
+
+float halfToFloat (GLushort half)
+{
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    float value;
+    if (exponent == 0)
+        value = ldexp((float)mantissa, -24);
+    else if (exponent == 31)
+        value = INFINITY;
+    else
+        value = ldexp((float)(mantissa | 0x400), exponent - 25);
+    return (half & 0x8000) ? -value : value;
+}
+
+/* Pick the layout for a mesh: half float positions only when they stay within tolerance */
+VertexFormat negotiateVertexFormat (VertexFormat requested, int numVertices, const GLfloat* vertex_buffer_data)
+{
+    if (requested != VERTEX_PACKED_AUTO)
+        return requested;
+    for (int i=0; i<3*numVertices; i++) {
+        if (fabs(halfToFloat(floatToHalf(vertex_buffer_data[i])) - vertex_buffer_data[i]) > HALF_POSITION_TOLERANCE)
+            return VERTEX_PACKED_FLOAT;
+    }
+    return VERTEX_PACKED_HALF;
+}
+
+GLubyte colorToByte (GLfloat value)
+{
+    value = value < 0 ? 0 : (value > 1 ? 1 : value);
+    return (GLubyte)(value*255.0f + 0.5f);
+}
+
 /* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_PACKED_AUTO)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->IndexBuffer = 0;
+    vao->NumIndices = 0;
+    vao->IndexType = GL_UNSIGNED_SHORT;
+    vao->OffsetBuffer = 0;
+    vao->SharedBuffers = false;
+    vao->NumInstances = 0;
+    format = negotiateVertexFormat(format, numVertices, vertex_buffer_data);
+    vao->Format = format;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+
+    if (format != VERTEX_SEPARATE_FLOAT) {
+        // Interleaved: position, then color, in one VBO
+        bool half = (format == VERTEX_PACKED_HALF);
+        GLsizei positionSize = half ? 4*sizeof(GLushort) : 3*sizeof(GLfloat); // half xyz is padded to 8 bytes
+        vao->PositionType = half ? GL_HALF_FLOAT : GL_FLOAT;
+        vao->ColorType = GL_UNSIGNED_BYTE;
+        vao->Stride = positionSize + 4*sizeof(GLubyte);
+        vao->ColorBuffer = 0;
+
+        vector<GLubyte> packed(numVertices*vao->Stride, 0);
+        for (int i=0; i<numVertices; i++) {
+            GLubyte* vertex = &packed[i*vao->Stride];
+            for (int c=0; c<3; c++) {
+                if (half) {
+                    GLushort h = floatToHalf(vertex_buffer_data[3*i + c]);
+                    memcpy(vertex + c*sizeof(GLushort), &h, sizeof(h));
+                }
+                else
+                    memcpy(vertex + c*sizeof(GLfloat), &vertex_buffer_data[3*i + c], sizeof(GLfloat));
+                vertex[positionSize + c] = colorToByte(color_buffer_data[3*i + c]);
+            }
+            vertex[positionSize + 3] = 255;
+        }
+
+        stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the interleaved VBO
+        glBufferData (GL_ARRAY_BUFFER, packed.size(), packed.empty() ? NULL : &packed[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, vao->PositionType, GL_FALSE, vao->Stride, (void*)0); // attribute 0. Vertices
+        glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, vao->Stride, (void*)(size_t)positionSize); // attribute 1. Color, 0-255 -> 0-1
+        return vao;
+    }
+
+    vao->PositionType = GL_FLOAT;
+    vao->ColorType = GL_FLOAT;
+    vao->Stride = 0;
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
@@ -165,7 +483,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           (void*)0            // array buffer offset
                           );
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
@@ -180,7 +498,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 }
 
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_PACKED_AUTO)
 {
     GLfloat* color_buffer_data = new GLfloat [3*numVertices];
     for (int i=0; i<numVertices; i++) {
@@ -189,30 +507,639 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode, format);
+}
+
+/* Collects triangles and welds identical position/color pairs into an indexed mesh */
+struct MeshBuilder {
+    vector<GLfloat> Positions; // 3 per unique vertex
+    vector<GLfloat> Colors;    // 3 per unique vertex
+    vector<GLuint> Indices;    // one per emitted vertex
+    map< array<GLfloat,6>, GLuint > Lookup;
+};
+
+GLuint addVertex (MeshBuilder& mesh, const GLfloat* position, const GLfloat* color)
+{
+    array<GLfloat,6> key = {{ position[0], position[1], position[2], color[0], color[1], color[2] }};
+    map< array<GLfloat,6>, GLuint >::iterator found = mesh.Lookup.find(key);
+    GLuint index;
+    if (found != mesh.Lookup.end())
+        index = found->second;
+    else {
+        index = mesh.Positions.size()/3;
+        mesh.Positions.insert(mesh.Positions.end(), position, position + 3);
+        mesh.Colors.insert(mesh.Colors.end(), color, color + 3);
+        mesh.Lookup[key] = index;
+    }
+    mesh.Indices.push_back(index);
+    return index;
+}
+
+/* Append unindexed vertex/color arrays (the create3DObject inputs) to the builder */
+void addVertices (MeshBuilder& mesh, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+    for (int i=0; i<numVertices; i++)
+        addVertex(mesh, &vertex_buffer_data[3*i], &color_buffer_data[3*i]);
+}
+
+/* Generate VAO, VBOs and an element buffer for the welded mesh */
+struct VAO* create3DObjectIndexed (GLenum primitive_mode, const MeshBuilder& mesh, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_PACKED_AUTO)
+{
+    int numVertices = mesh.Positions.size()/3;
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, &mesh.Positions[0], &mesh.Colors[0], fill_mode, format);
+    vao->NumIndices = mesh.Indices.size();
+
+    glGenBuffers (1, &(vao->IndexBuffer)); // EBO - indices
+    stateBindVertexArray (vao->VertexArrayID); // the element buffer binding is VAO state
+    stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+    if (numVertices <= 65536) {
+        vector<GLushort> shortIndices(mesh.Indices.begin(), mesh.Indices.end());
+        vao->IndexType = GL_UNSIGNED_SHORT;
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, shortIndices.size()*sizeof(GLushort), &shortIndices[0], GL_STATIC_DRAW);
+    }
+    else {
+        vao->IndexType = GL_UNSIGNED_INT;
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, mesh.Indices.size()*sizeof(GLuint), &mesh.Indices[0], GL_STATIC_DRAW);
+    }
+    return vao;
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    statePolygonMode (vao->FillMode);
 
     // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    stateBindVertexArray (vao->VertexArrayID);
 
     // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
+    stateEnableVertexAttribArray(0);
     // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
 
     // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    stateEnableVertexAttribArray(1);
+    // Bind the VBO to use (interleaved layouts keep colors in the vertex VBO)
+    if (vao->ColorBuffer != 0)
+        stateBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer);
 
     // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    if (vao->IndexBuffer != 0)
+        glDrawElements(vao->PrimitiveMode, vao->NumIndices, vao->IndexType, (void*)0);
+    else
+        glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
+
+/* Render vertices [first, first+count) of an unindexed VAO */
+void draw3DObjectRange (struct VAO* vao, int first, int count)
+{
+    statePolygonMode (vao->FillMode);
+    stateBindVertexArray (vao->VertexArrayID);
+    glDrawArrays(vao->PrimitiveMode, first, count);
+}
+
+/* Attach a per-instance offset buffer (attribute 2) to the VAO */
+void setInstanceOffsets (struct VAO* vao, const vector<glm::vec3>& offsets)
+{
+    if (vao->OffsetBuffer == 0)
+        glGenBuffers (1, &(vao->OffsetBuffer)); // VBO - instance offsets
+    vao->NumInstances = offsets.size();
+
+    stateBindVertexArray (vao->VertexArrayID);
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->OffsetBuffer);
+    glBufferData (GL_ARRAY_BUFFER, offsets.size()*sizeof(glm::vec3), offsets.empty() ? NULL : &offsets[0], GL_STATIC_DRAW);
+    glVertexAttribPointer(
+                          2,                  // attribute 2. Instance offset
+                          3,                  // size (x,y,z)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          sizeof(glm::vec3),  // stride
+                          (void*)0            // array buffer offset
+                          );
+    glVertexAttribDivisor(2, 1); // advance once per instance
+    stateEnableVertexAttribArray(2);
+}
+
+/* A new VAO drawing obj's vertex and index buffers, with instance offsets of its own */
+struct VAO* createInstancedView (const struct VAO* obj, GLenum fill_mode)
+{
+    struct VAO* vao = new struct VAO;
+    *vao = *obj;
+    vao->FillMode = fill_mode;
+    vao->OffsetBuffer = 0;
+    vao->NumInstances = 0;
+    vao->SharedBuffers = true;
+
+    glGenVertexArrays(1, &(vao->VertexArrayID));
+    stateBindVertexArray (vao->VertexArrayID);
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    if (vao->ColorBuffer == 0) {
+        // Interleaved: color is the last 4 bytes of each vertex
+        glVertexAttribPointer(0, 3, vao->PositionType, GL_FALSE, vao->Stride, (void*)0);
+        glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, vao->Stride, (void*)(size_t)(vao->Stride - 4*sizeof(GLubyte)));
+    }
+    else {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        stateBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    }
+    if (vao->IndexBuffer != 0)
+        stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+    return vao;
+}
+
+/* Render every instance of the VAO with a single draw call */
+void draw3DObjectInstanced (struct VAO* vao)
+{
+    if (vao->NumInstances == 0)
+        return;
+
+    statePolygonMode (vao->FillMode);
+    stateBindVertexArray (vao->VertexArrayID);
+    stateEnableVertexAttribArray(0);
+    stateEnableVertexAttribArray(1);
+    if (vao->IndexBuffer != 0)
+        glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, vao->IndexType, (void*)0, vao->NumInstances);
+    else
+        glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, vao->NumInstances);
+}
+
+/* A queued draw: which mesh, with which program/fill mode, and where */
+struct RenderCommand {
+    int Layer;          // lower layers draw first; state sorting happens within a layer
+    GLuint Program;
+    GLint ModelID;      // "Model" uniform of Program, -1 if it has none
+    struct VAO* Object;
+    GLenum FillMode;
+    int First, Count;   // vertex range to draw; Count 0 draws the whole VAO
+    bool Instanced;
+    bool Static;        // the level's static scene, see drawStaticScene()
+    glm::mat4 Model;
+};
+
+vector<RenderCommand> renderQueue;
+
+/* Queue obj for this frame; it is drawn by flushRenderQueue() */
+void submitDraw (struct VAO* obj, const glm::mat4& model, int layer=0)
+{
+    RenderCommand command;
+    command.Layer = layer;
+    command.Program = programID;
+    command.ModelID = Matrices.ModelID;
+    command.Object = obj;
+    command.FillMode = obj->FillMode;
+    command.First = 0;
+    command.Count = 0;
+    command.Instanced = false;
+    command.Static = false;
+    command.Model = model;
+    renderQueue.push_back(command);
+}
+
+/* Queue all instances of obj; their offsets already are world positions */
+void submitInstanced (struct VAO* obj, int layer=0)
+{
+    submitDraw(obj, glm::mat4(1.0f), layer);
+    renderQueue.back().Program = instancedProgramID;
+    renderQueue.back().ModelID = -1;
+    renderQueue.back().Instanced = true;
+}
+
+/* Vertex of streamed geometry, laid out like VERTEX_PACKED_FLOAT */
+struct StreamVertex {
+    GLfloat Position[3];
+    GLubyte Color[4];
+};
+
+/* Geometry that moves every frame, kept on the CPU as a plain triangle list */
+struct DynamicMesh {
+    vector<GLfloat> Positions; // 3 per vertex
+    vector<GLfloat> Colors;    // 3 per vertex
+};
+
+/* Ring of per-frame regions that moving geometry is written into, already
+   transformed, so it can be drawn in a few large draws. With
+   GL_ARB_buffer_storage the buffer stays persistently mapped and each region
+   is fenced; otherwise the buffer is orphaned every frame. */
+const int STREAM_REGIONS = 3; // frames the GPU may lag behind
+
+struct StreamBuffer {
+    struct VAO* Object;     // unindexed GL_TRIANGLES, VertexBuffer is the ring
+    GLsizeiptr RegionSize;  // bytes, a multiple of sizeof(StreamVertex)
+    int Region;             // region written this frame
+    bool Persistent;
+    GLubyte* Mapped;        // start of the ring when persistent
+    GLsync Fences[STREAM_REGIONS];
+    unsigned long Stalls;   // frames that had to wait for the GPU anyway
+} streamBuffer = { NULL, 0, 0, false, NULL, { 0 }, 0 };
+
+map< int, vector<StreamVertex> > streamBatches; // this frame's vertices, per layer
+
+void allocateStreamBuffer (GLsizeiptr regionSize)
+{
+    struct VAO* vao = streamBuffer.Object;
+    if (vao == NULL) {
+        vao = new struct VAO;
+        memset(vao, 0, sizeof(struct VAO));
+        vao->PrimitiveMode = GL_TRIANGLES;
+        vao->FillMode = GL_FILL;
+        vao->Format = VERTEX_PACKED_FLOAT;
+        vao->PositionType = GL_FLOAT;
+        vao->ColorType = GL_UNSIGNED_BYTE;
+        vao->Stride = sizeof(StreamVertex);
+        glGenVertexArrays(1, &(vao->VertexArrayID));
+        streamBuffer.Object = vao;
+    }
+    else
+        stateDeleteBuffer(vao->VertexBuffer); // also unmaps it; draws already queued keep their data
+    for (int i=0; i<STREAM_REGIONS; i++) {
+        if (streamBuffer.Fences[i])
+            glDeleteSync(streamBuffer.Fences[i]);
+        streamBuffer.Fences[i] = 0;
+    }
+    streamBuffer.RegionSize = regionSize - regionSize % sizeof(StreamVertex);
+    streamBuffer.Region = 0;
+    streamBuffer.Mapped = NULL;
+
+    glGenBuffers (1, &(vao->VertexBuffer));
+    stateBindVertexArray (vao->VertexArrayID);
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    streamBuffer.Persistent = GLAD_GL_ARB_buffer_storage != 0;
+    if (streamBuffer.Persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, STREAM_REGIONS*streamBuffer.RegionSize, NULL, flags);
+        streamBuffer.Mapped = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, STREAM_REGIONS*streamBuffer.RegionSize, flags);
+        if (streamBuffer.Mapped == NULL) { // storage is immutable, start over with a plain buffer
+            streamBuffer.Persistent = false;
+            stateDeleteBuffer(vao->VertexBuffer);
+            glGenBuffers (1, &(vao->VertexBuffer));
+            stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+        }
+    }
+    if (!streamBuffer.Persistent)
+        glBufferData (GL_ARRAY_BUFFER, streamBuffer.RegionSize, NULL, GL_STREAM_DRAW);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(StreamVertex), (void*)offsetof(StreamVertex, Position)); // attribute 0. Vertices
+    glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(StreamVertex), (void*)offsetof(StreamVertex, Color)); // attribute 1. Color
+    stateEnableVertexAttribArray(0);
+    stateEnableVertexAttribArray(1);
+}
+
+/* Queue mesh, transformed by model on the CPU, into this frame's stream batch */
+void submitDynamic (const DynamicMesh& mesh, const glm::mat4& model, int layer=0)
+{
+    vector<StreamVertex>& batch = streamBatches[layer];
+    size_t numVertices = mesh.Positions.size()/3;
+    for (size_t i=0; i<numVertices; i++) {
+        glm::vec4 position = model * glm::vec4(mesh.Positions[3*i], mesh.Positions[3*i + 1], mesh.Positions[3*i + 2], 1);
+        StreamVertex vertex;
+        vertex.Position[0] = position.x;
+        vertex.Position[1] = position.y;
+        vertex.Position[2] = position.z;
+        for (int c=0; c<3; c++)
+            vertex.Color[c] = colorToByte(mesh.Colors[3*i + c]);
+        vertex.Color[3] = 255;
+        batch.push_back(vertex);
+    }
+}
+
+/* Copy this frame's batches into the next ring region and queue one draw per layer */
+void uploadStreamBatches ()
+{
+    size_t numVertices = 0;
+    for (map< int, vector<StreamVertex> >::iterator it = streamBatches.begin(); it != streamBatches.end(); ++it)
+        numVertices += it->second.size();
+    if (numVertices == 0)
+        return;
+
+    GLsizeiptr bytes = numVertices*sizeof(StreamVertex);
+    if (streamBuffer.Object == NULL || bytes > streamBuffer.RegionSize)
+        allocateStreamBuffer(max(2*bytes, (GLsizeiptr)65536));
+
+    GLubyte* destination;
+    int first = 0;
+    if (streamBuffer.Persistent) {
+        int region = (streamBuffer.Region + 1) % STREAM_REGIONS;
+        GLsync& fence = streamBuffer.Fences[region];
+        if (fence) {
+            // Normally signalled long ago; only block if the GPU is a whole ring
+            // behind, and then for as long as it takes, since it still reads the region
+            GLenum waited = glClientWaitSync(fence, 0, 0);
+            if (waited == GL_TIMEOUT_EXPIRED) {
+                streamBuffer.Stalls++;
+                do
+                    waited = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+                while (waited == GL_TIMEOUT_EXPIRED);
+            }
+            if (waited == GL_WAIT_FAILED)
+                glFinish(); // the fence cannot say; wait until the GPU is done with everything
+            glDeleteSync(fence);
+            fence = 0;
+        }
+        streamBuffer.Region = region;
+        destination = streamBuffer.Mapped + region*streamBuffer.RegionSize;
+        first = region*streamBuffer.RegionSize/sizeof(StreamVertex);
+    }
+    else {
+        // Orphan the old storage, the driver hands back a fresh block without waiting
+        stateBindBuffer (GL_ARRAY_BUFFER, streamBuffer.Object->VertexBuffer);
+        glBufferData (GL_ARRAY_BUFFER, streamBuffer.RegionSize, NULL, GL_STREAM_DRAW);
+        destination = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+
+    for (map< int, vector<StreamVertex> >::iterator it = streamBatches.begin(); it != streamBatches.end(); ++it) {
+        int count = it->second.size();
+        if (count == 0)
+            continue;
+        memcpy(destination, &it->second[0], count*sizeof(StreamVertex));
+        destination += count*sizeof(StreamVertex);
+
+        submitDraw(streamBuffer.Object, glm::mat4(1.0f), it->first);
+        renderQueue.back().First = first;
+        renderQueue.back().Count = count;
+        first += count;
+        it->second.clear(); // keeps the capacity for the next frame
+    }
+
+    if (!streamBuffer.Persistent)
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+/* Called once the frame's draws are issued: the region is reusable when this fence signals */
+void fenceStreamRegion ()
+{
+    if (streamBuffer.Persistent && streamBuffer.Fences[streamBuffer.Region] == 0)
+        streamBuffer.Fences[streamBuffer.Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void printStreamCounters ()
+{
+    printf("Stream buffer: %s, %lu frames waited on the GPU\n", streamBuffer.Persistent ? "persistent" : "orphaned", streamBuffer.Stalls);
+}
+
+/* Layout of one record in a GL_DRAW_INDIRECT_BUFFER */
+struct DrawElementsIndirectCommand {
+    GLuint Count;
+    GLuint InstanceCount;
+    GLuint FirstIndex;
+    GLint BaseVertex;
+    GLuint BaseInstance;
+};
+
+/* One mesh of the level's scenery, placed at each of its offsets */
+struct StaticPart {
+    DynamicMesh Mesh;
+    vector<glm::vec3> Offsets;
+    GLenum FillMode;
+};
+
+/* Scenery that only changes with the level. All parts share one vertex, index
+   and instance-offset buffer and are drawn from a command list recorded when
+   the level is set up; with GL_ARB_multi_draw_indirect (GL 4.3) the GPU reads
+   the list itself, otherwise it is replayed with one draw per command. */
+struct StaticScene {
+    vector<StaticPart> Parts;
+    struct VAO* Object;       // every part, welded per part, GL_TRIANGLES indexed
+    vector<DrawElementsIndirectCommand> Commands; // grouped by fill mode
+    vector<GLenum> FillModes; // per command
+    GLuint CommandBuffer;
+    bool Indirect;
+    bool Built;               // buffers match Parts
+} staticScene;
+
+void clearStaticScene ()
+{
+    staticScene.Parts.clear();
+    staticScene.Built = false;
+}
+
+void addStaticPart (const DynamicMesh& mesh, const vector<glm::vec3>& offsets, GLenum fill_mode=GL_FILL)
+{
+    StaticPart part;
+    part.Mesh = mesh;
+    part.Offsets = offsets;
+    part.FillMode = fill_mode;
+    staticScene.Parts.push_back(part);
+    staticScene.Built = false;
+}
+
+/* Free the VAO and every buffer it owns */
+void delete3DObject (struct VAO* vao)
+{
+    GLuint buffers[] = { vao->OffsetBuffer, vao->VertexBuffer, vao->ColorBuffer, vao->IndexBuffer };
+    int owned = vao->SharedBuffers ? 1 : 4; // a view only owns its offsets
+    for (int i=0; i<owned; i++)
+        if (buffers[i] != 0)
+            stateDeleteBuffer(buffers[i]);
+    stateDeleteVertexArray(vao->VertexArrayID);
+    delete vao;
+}
+
+/* Weld every part into the shared buffers and record its draw command */
+void buildStaticScene ()
+{
+    if (staticScene.Object != NULL)
+        delete3DObject(staticScene.Object);
+    staticScene.Object = NULL;
+    staticScene.Commands.clear();
+    staticScene.FillModes.clear();
+    staticScene.Built = true;
+
+    // Filled parts first, then wireframe, so each fill mode is one contiguous run
+    vector<const StaticPart*> parts;
+    for (size_t i=0; i<staticScene.Parts.size(); i++)
+        if (staticScene.Parts[i].FillMode == GL_FILL)
+            parts.push_back(&staticScene.Parts[i]);
+    for (size_t i=0; i<staticScene.Parts.size(); i++)
+        if (staticScene.Parts[i].FillMode != GL_FILL)
+            parts.push_back(&staticScene.Parts[i]);
+
+    MeshBuilder all; // indices stay local to their part, BaseVertex rebases them
+    vector<glm::vec3> offsets;
+    for (size_t i=0; i<parts.size(); i++) {
+        if (parts[i]->Offsets.empty() || parts[i]->Mesh.Positions.empty())
+            continue;
+        MeshBuilder mesh;
+        addVertices(mesh, parts[i]->Mesh.Positions.size()/3, &parts[i]->Mesh.Positions[0], &parts[i]->Mesh.Colors[0]);
+
+        DrawElementsIndirectCommand command;
+        command.Count = mesh.Indices.size();
+        command.InstanceCount = parts[i]->Offsets.size();
+        command.FirstIndex = all.Indices.size();
+        command.BaseVertex = all.Positions.size()/3;
+        command.BaseInstance = offsets.size();
+        staticScene.Commands.push_back(command);
+        staticScene.FillModes.push_back(parts[i]->FillMode);
+
+        all.Positions.insert(all.Positions.end(), mesh.Positions.begin(), mesh.Positions.end());
+        all.Colors.insert(all.Colors.end(), mesh.Colors.begin(), mesh.Colors.end());
+        all.Indices.insert(all.Indices.end(), mesh.Indices.begin(), mesh.Indices.end());
+        offsets.insert(offsets.end(), parts[i]->Offsets.begin(), parts[i]->Offsets.end());
+    }
+    if (staticScene.Commands.empty())
+        return;
+
+    staticScene.Object = create3DObjectIndexed(GL_TRIANGLES, all, GL_FILL);
+    setInstanceOffsets(staticScene.Object, offsets);
+
+    // baseInstance is only honoured by the indirect path with ARB_base_instance (GL 4.2)
+    staticScene.Indirect = GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance;
+    if (staticScene.Indirect) {
+        if (staticScene.CommandBuffer == 0)
+            glGenBuffers (1, &staticScene.CommandBuffer);
+        stateBindBuffer (GL_DRAW_INDIRECT_BUFFER, staticScene.CommandBuffer);
+        glBufferData (GL_DRAW_INDIRECT_BUFFER, staticScene.Commands.size()*sizeof(DrawElementsIndirectCommand), &staticScene.Commands[0], GL_STATIC_DRAW);
+    }
+}
+
+/* Draw the whole static scene: one multi-draw per fill mode, or the CPU loop */
+void drawStaticScene ()
+{
+    if (!staticScene.Built)
+        buildStaticScene();
+    struct VAO* vao = staticScene.Object;
+    if (vao == NULL)
+        return;
+
+    stateBindVertexArray (vao->VertexArrayID);
+    stateEnableVertexAttribArray(0);
+    stateEnableVertexAttribArray(1);
+    if (staticScene.Indirect)
+        stateBindBuffer (GL_DRAW_INDIRECT_BUFFER, staticScene.CommandBuffer);
+    else
+        stateBindBuffer (GL_ARRAY_BUFFER, vao->OffsetBuffer);
+    GLsizei indexSize = vao->IndexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+
+    size_t begin = 0;
+    while (begin < staticScene.Commands.size()) {
+        size_t end = begin;
+        while (end < staticScene.Commands.size() && staticScene.FillModes[end] == staticScene.FillModes[begin])
+            end++;
+        statePolygonMode (staticScene.FillModes[begin]);
+
+        if (staticScene.Indirect)
+            glMultiDrawElementsIndirect(GL_TRIANGLES, vao->IndexType, (void*)(begin*sizeof(DrawElementsIndirectCommand)), end - begin, 0);
+        else {
+            for (size_t i=begin; i<end; i++) {
+                const DrawElementsIndirectCommand& command = staticScene.Commands[i];
+                // GL 3.3 has no base instance: start attribute 2 at the part's first offset instead
+                glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)(command.BaseInstance*sizeof(glm::vec3)));
+                glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.Count, vao->IndexType, (void*)(size_t)(command.FirstIndex*indexSize), command.InstanceCount, command.BaseVertex);
+            }
+        }
+        begin = end;
+    }
+}
+
+/* Queue the level's static scenery; it is one command however many parts it has */
+void submitStaticScene (int layer=0)
+{
+    if (!staticScene.Built)
+        buildStaticScene();
+    if (staticScene.Object == NULL)
+        return;
+    submitInstanced(staticScene.Object, layer);
+    renderQueue.back().Static = true;
+}
+
+/* Create the camera uniform buffer and attach the Camera block of each program to it */
+void createCameraBlock (const vector<GLuint>& programs)
+{
+    glGenBuffers (1, &Matrices.CameraBuffer);
+    stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BINDING, Matrices.CameraBuffer);
+    for (size_t i=0; i<programs.size(); i++)
+        glUniformBlockBinding (programs[i], glGetUniformBlockIndex(programs[i], "Camera"), CAMERA_BINDING);
+    Matrices.CameraUploaded = glm::mat4(0.0f); // no valid camera yet, forces the first upload
+}
+
+/* The six clip planes of a view-projection matrix, normals pointing inwards */
+struct Frustum {
+    glm::vec4 Planes[6];
+};
+
+enum FrustumTest { FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTS, FRUSTUM_INSIDE };
+
+Frustum extractFrustum (const glm::mat4& VP)
+{
+    glm::vec4 rows[4];
+    for (int i=0; i<4; i++)
+        rows[i] = glm::vec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+    Frustum frustum;
+    for (int i=0; i<3; i++) {
+        frustum.Planes[2*i] = rows[3] + rows[i];
+        frustum.Planes[2*i + 1] = rows[3] - rows[i];
+    }
+    return frustum;
+}
+
+/* Classify an axis-aligned box against the frustum */
+FrustumTest testBox (const Frustum& frustum, const glm::vec3& lo, const glm::vec3& hi)
+{
+    FrustumTest result = FRUSTUM_INSIDE;
+    for (int i=0; i<6; i++) {
+        const glm::vec4& plane = frustum.Planes[i];
+        // The corner furthest along the normal decides "outside", the nearest one "inside"
+        glm::vec3 far(plane.x >= 0 ? hi.x : lo.x, plane.y >= 0 ? hi.y : lo.y, plane.z >= 0 ? hi.z : lo.z);
+        glm::vec3 near(plane.x >= 0 ? lo.x : hi.x, plane.y >= 0 ? lo.y : hi.y, plane.z >= 0 ? lo.z : hi.z);
+        if (glm::dot(glm::vec3(plane), far) + plane.w < 0)
+            return FRUSTUM_OUTSIDE;
+        if (glm::dot(glm::vec3(plane), near) + plane.w < 0)
+            result = FRUSTUM_INTERSECTS;
+    }
+    return result;
+}
+
+/* Projection * View for the whole frame; skipped when the camera did not move */
+void uploadCamera ()
+{
+    glm::mat4 VP = Matrices.projection * Matrices.view;
+    if (memcmp(&VP[0][0], &Matrices.CameraUploaded[0][0], sizeof(glm::mat4)) == 0)
+        return;
+    Matrices.CameraUploaded = VP;
+    stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &VP[0][0]);
+}
+
+/* Sort key: layer, then the state each draw needs, so equal state ends up adjacent */
+bool renderCommandLess (const RenderCommand& a, const RenderCommand& b)
+{
+    if (a.Layer != b.Layer)
+        return a.Layer < b.Layer;
+    if (a.Program != b.Program)
+        return a.Program < b.Program;
+    if (a.Object->VertexArrayID != b.Object->VertexArrayID)
+        return a.Object->VertexArrayID < b.Object->VertexArrayID;
+    return a.FillMode < b.FillMode;
+}
+
+/* Sort and draw everything submitted this frame with the current camera */
+void flushRenderQueue ()
+{
+    uploadStreamBatches();
+
+    // stable: commands with the same key keep their submission order
+    stable_sort(renderQueue.begin(), renderQueue.end(), renderCommandLess);
+
+    uploadCamera();
+    for (size_t i=0; i<renderQueue.size(); i++) {
+        const RenderCommand& command = renderQueue[i];
+        stateUseProgram (command.Program);
+        if (command.ModelID >= 0)
+            stateUniformMatrix4fv(command.ModelID, command.Model);
+        if (command.Static)
+            drawStaticScene();
+        else if (command.Instanced)
+            draw3DObjectInstanced(command.Object);
+        else if (command.Count > 0)
+            draw3DObjectRange(command.Object, command.First, command.Count);
+        else
+            draw3DObject(command.Object);
+    }
+    renderQueue.clear();
+    fenceStreamRegion();
 }
 
 void* play_audio(string audioFile){   
@@ -275,156 +1202,801 @@ bool rotate_build=1,player_eye=0,dont_show=0,dont_show1=0,ind=1,inw=0,ina=0,ins=
 int bigradius=40;
 double xmousePos,ymousePos,xmousePos1,ymousePos1;
 int shiftx = 0,shifty=0;
-float horizontal_position=0,vertical_position=0,angle_thrown=M_PI/2.5,initial_velocity=7.7,time_travel=0,z_position=0;
+float horizontal_position=0,vertical_position=0,angle_thrown=M_PI/2.5,initial_velocity=7.7,z_position=0;
 bool jump_initiated = 0;
+int jump_ticks = 0; // ticks since the jump started
 int toaddh=1,toaddv=-1;
-float board_position = 2.8,dire=1.0,forboardmovement=0,storeinitialposition=0;
-bool onboard=0,work=0;
-
-int const test[10][10] = {{9,9,9,7,9,7,9,9,9,9},
-                {9,9,5,9,9,9,1,9,9,9},
-                {9,9,9,5,9,9,9,9,9,9},
-                {5,9,9,12,9,7,9,7,9,1},
-                {5,9,9,9,1,9,9,9,5,9},
-                {5,9,9,12,9,9,9,9,9,9},
-                {5,5,9,9,9,9,1,12,9,9},
-                {9,9,1,9,9,2,9,9,9,1},
-                {9,9,9,9,1,9,5,9,9,9},
-                {9,9,1,9,3,9,9,9,9,9}};
 
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* The level is a grid of columns, each a stack of cubes. Columns are stored in
+   CHUNK_SIZE x CHUNK_SIZE chunks: maps can be large (1024x1024 columns and
+   more), and an edit only re-meshes the chunk it lands in. */
+const int CHUNK_SIZE = 16;
+
+struct WorldChunk {
+    unsigned char Heights[CHUNK_SIZE][CHUNK_SIZE]; // cubes per column, [row][column]
+    int MaxHeight;       // tallest column when last meshed, bounds the chunk's box
+    bool Dirty;          // heights changed since the chunk was last meshed
+    VAO* Filled;         // greedy mesh of the filled cubes, world space; NULL when there are none
+    VAO* Wire;           // instanced view of the shared cube mesh, NULL until needed
+};
+
+/* A solid box of filled cubes, world space; what the occlusion culler draws */
+struct OccluderBox {
+    glm::vec3 Lo, Hi;
+};
+
+struct World {
+    int Rows, Columns;          // size in columns
+    int ChunkRows, ChunkColumns;
+    vector<WorldChunk> Chunks;  // ChunkRows x ChunkColumns, row-major
+    vector< vector<OccluderBox> > Occluders; // per chunk, rebuilt with its mesh
+    int Remeshed;               // chunks re-meshed by the last updateWorldMeshes()
+} world;
+
+/* Collision runs on tiles, one per column of the world, kept beside the
+   chunked heights and updated with them. A ring of empty tiles pads the map
+   and positions further out clamp onto it, so every query is a bounds-checked
+   O(1) read, and a tile's neighbors need no checks of their own. The bitsets
+   answer what the player code asks on every key press and frame at the
+   walking height: does a tile block a step, does it drop away, and does the
+   tile in the next row drop away. */
+const int WALK_HEIGHT = 9; // cubes under a player walking on the map
+
+struct TileMap {
+    int Rows, Columns;
+    int Stride;                       // Columns plus the padding on both sides
+    vector<unsigned char> Heights;    // (Rows+2) x Stride, padding included
+    vector<uint64_t> Blocked;         // taller than WALK_HEIGHT
+    vector<uint64_t> Low;             // lower than WALK_HEIGHT
+    vector<uint64_t> LowAhead;        // the tile in the next row is Low
+} tiles;
+
+int tileIndex (const TileMap& map, int row, int column)
 {
-    if (action == GLFW_RELEASE) {
-        switch (key) {
-            case GLFW_KEY_C:
-                rectangle_rot_status = !rectangle_rot_status;
-                break;
-            case GLFW_KEY_P:
-                triangle_rot_status = !triangle_rot_status;
-                break;
-            case GLFW_KEY_X:
-                // do something ..
-                break;
-            default:
-                break;
-        }
-    }
-    else if (action == GLFW_PRESS) {
-        switch (key) {
-            case GLFW_KEY_ESCAPE:
-                quit(window);
-                break;
-            case GLFW_KEY_LEFT:
-                  ho_t-=0.2;
-                  x_turn=1;
-                  z_turn=0;
-                  ho_t = floor(ho_t*10);
-                  ho_t=ho_t/10;
-                  no_of_walks=1;
-                  if(player_eye==1)
-                  {
-                    dont_show=1;
-                    dont_show1=0;
-                  }
-                  ind=0;
-                  ina=1;
-                  inw=0;
-                  ins=0;
-                  // thread(play_audio,"Mario - Jump.mp3").detach();
-                  if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9 && player_height==9)
-                    ho_t+=0.2;
-                  break;
-            case GLFW_KEY_RIGHT:
-                x_turn=1;
-                z_turn=0;
-                // if(arrow_work==0)
-                ho_t+=0.2;
-                ho_t = floor(ho_t*10);
-                ho_t=ho_t/10;
-                no_of_walks=1;
-                if(player_eye==1)
-                {
-                  dont_show=1;
-                  dont_show1=0;
+    row = max(-1, min(row, map.Rows));
+    column = max(-1, min(column, map.Columns));
+    return (row+1)*map.Stride + column+1;
+}
+
+bool tileBit (const vector<uint64_t>& bits, int index)
+{
+    return (bits[index >> 6] >> (index & 63)) & 1;
+}
+
+void setTileBit (vector<uint64_t>& bits, int index, bool value)
+{
+    if (value)
+        bits[index >> 6] |= (uint64_t)1 << (index & 63);
+    else
+        bits[index >> 6] &= ~((uint64_t)1 << (index & 63));
+}
+
+int tileHeight (const TileMap& map, int row, int column)
+{
+    return map.Heights[tileIndex(map, row, column)];
+}
+
+bool tileBlocked (const TileMap& map, int row, int column)
+{
+    return tileBit(map.Blocked, tileIndex(map, row, column));
+}
+
+/* Every tile empty */
+void createTileMap (TileMap& map, int rows, int columns)
+{
+    map.Rows = rows;
+    map.Columns = columns;
+    map.Stride = columns + 2;
+    size_t count = (size_t)(rows+2)*map.Stride, words = (count + 63)/64;
+    map.Heights.assign(count, 0);
+    map.Blocked.assign(words, 0);
+    map.Low.assign(words, ~(uint64_t)0);
+    map.LowAhead.assign(words, ~(uint64_t)0);
+}
+
+void setTileHeight (TileMap& map, int row, int column, int height)
+{
+    if (row < 0 || column < 0 || row >= map.Rows || column >= map.Columns)
+        return;
+    int index = tileIndex(map, row, column);
+    map.Heights[index] = height;
+    setTileBit(map.Blocked, index, height > WALK_HEIGHT);
+    setTileBit(map.Low, index, height < WALK_HEIGHT);
+    setTileBit(map.LowAhead, index - map.Stride, height < WALK_HEIGHT); // the tile a row before
+}
+
+/* The player's position in steps of 0.2, half a tile: X along x as ho_t,
+   Z along the rows as -vo_t. ho_t and vo_t follow it, for drawing. */
+struct PlayerPosition {
+    int X, Z;
+} playerPosition;
+
+// The tile a position in steps is on; rounded toward zero, as the game always has
+int stepTile (int steps)
+{
+    return steps/2;
+}
+
+int playerRow ()
+{
+    return stepTile(playerPosition.Z);
+}
+
+int playerColumn ()
+{
+    return stepTile(playerPosition.X);
+}
+
+void placePlayer (int x, int z)
+{
+    playerPosition.X = x;
+    playerPosition.Z = z;
+    ho_t = x*0.2;
+    vo_t = -z*0.2;
+}
+
+/* Whether a player at the walking height may not step to (x, z): the tile
+   there blocks or, on a step along x taken between two rows, the tile in
+   the next row does */
+bool stepBlocked (const TileMap& map, int x, int z, bool alongX)
+{
+    int row = stepTile(z), column = stepTile(x);
+    return tileBlocked(map, row, column) || (alongX && z%2 != 0 && tileBlocked(map, row+1, column));
+}
+
+/* Whether a player at rest at (x, z), with its feet at height, falls: the
+   tile under it is lower, and it stands square on it or the tile in the next
+   row is lower too */
+bool playerFalls (const TileMap& map, int x, int z, float height)
+{
+    int index = tileIndex(map, stepTile(z), stepTile(x));
+    if (height == WALK_HEIGHT) {
+        if (!tileBit(map.Low, index))
+            return false;
+        return (x%2 == 0 && z%2 == 0) || tileBit(map.LowAhead, index);
+    }
+    if (map.Heights[index] >= height)
+        return false;
+    return (x%2 == 0 && z%2 == 0) || tileHeight(map, stepTile(z)+1, stepTile(x)) < height;
+}
+
+/* A step of the player, undone when it runs into a blocking tile */
+void walkPlayer (int dx, int dz)
+{
+    int x = playerPosition.X + dx, z = playerPosition.Z + dz;
+    if (player_height == WALK_HEIGHT && stepBlocked(tiles, x, z, dx != 0))
+        return;
+    placePlayer(x, z);
+}
+
+void resetReachGraph ();  // with the reachability graph, below
+void forgetOcclusion ();  // with the occlusion culler, below
+void invalidateReach (int row, int column);
+
+WorldChunk& worldChunk (int row, int column)
+{
+    return world.Chunks[(row/CHUNK_SIZE)*world.ChunkColumns + column/CHUNK_SIZE];
+}
+
+/* Cubes stacked in a column; columns off the map are empty */
+int worldHeight (int row, int column)
+{
+    if (row < 0 || column < 0 || row >= world.Rows || column >= world.Columns)
+        return 0;
+    return worldChunk(row, column).Heights[row%CHUNK_SIZE][column%CHUNK_SIZE];
+}
+
+void setWorldHeight (int row, int column, int height)
+{
+    if (row < 0 || column < 0 || row >= world.Rows || column >= world.Columns)
+        return;
+    height = max(0, min(height, 255));
+    WorldChunk& chunk = worldChunk(row, column);
+    unsigned char& stored = chunk.Heights[row%CHUNK_SIZE][column%CHUNK_SIZE];
+    if (stored != height) {
+        stored = height;
+        chunk.Dirty = true;
+        setTileHeight(tiles, row, column, height);
+        invalidateReach(row, column);
+        // A column also decides which faces of its neighbors show, which may sit in the next chunk
+        int neighbors[4][2] = { {row-1, column}, {row+1, column}, {row, column-1}, {row, column+1} };
+        for (int n=0; n<4; n++)
+            if (neighbors[n][0] >= 0 && neighbors[n][1] >= 0 && neighbors[n][0] < world.Rows && neighbors[n][1] < world.Columns)
+                worldChunk(neighbors[n][0], neighbors[n][1]).Dirty = true;
+    }
+}
+
+/* An empty rows x columns world; meshes of the previous one are freed later, by updateWorldMeshes() */
+vector<VAO*> retiredChunkMeshes;
+
+void createWorld (int rows, int columns)
+{
+    for (size_t i=0; i<world.Chunks.size(); i++) {
+        if (world.Chunks[i].Filled != NULL) retiredChunkMeshes.pb(world.Chunks[i].Filled);
+        if (world.Chunks[i].Wire != NULL) retiredChunkMeshes.pb(world.Chunks[i].Wire);
+    }
+    world.Rows = rows;
+    world.Columns = columns;
+    world.ChunkRows = (rows + CHUNK_SIZE-1)/CHUNK_SIZE;
+    world.ChunkColumns = (columns + CHUNK_SIZE-1)/CHUNK_SIZE;
+    WorldChunk empty;
+    memset(&empty, 0, sizeof(empty));
+    world.Chunks.assign(world.ChunkRows*world.ChunkColumns, empty);
+    world.Occluders.assign(world.Chunks.size(), vector<OccluderBox>());
+    createTileMap(tiles, rows, columns);
+    resetReachGraph();
+    forgetOcclusion();
+}
+
+/* Levels ship as files next to the game. The editable form, levels/<name>.txt:
+
+     # a comment, up to the end of the line
+     size <rows> <columns>
+     spawn <row> <column>
+     goal <row> <column>
+     platform <x> <y> <start> <low> <high> <speed>
+     heights
+     <rows lines of <columns> heights, 0 to 255; nothing may follow>
+
+   `sample2D1 --import <text> <binary>` converts it into the binary form,
+   which the game maps with mmap() and copies into the world a chunk at a
+   time, without parsing anything. The binary form, native (little) endian:
+
+     LevelFileHeader
+     LevelPlatform[PlatformCount], at PlatformOffset
+     ChunkRows*ChunkColumns blocks of CHUNK_SIZE*CHUNK_SIZE heights, a byte
+     each, at HeightsOffset; row-major within a block, and blocks row-major,
+     exactly as WorldChunk::Heights. Columns past the map's edge are 0. */
+const char LEVEL_MAGIC[4] = { 'L', 'V', 'L', 'B' };
+const uint32_t LEVEL_VERSION = 1;
+const int LEVEL_MAX_SIZE = 4096; // rows and columns at most, so a map's tile indices fit an int
+
+struct LevelFileHeader {
+    char Magic[4];
+    uint32_t Version;
+    int32_t Rows, Columns, ChunkSize;
+    int32_t SpawnRow, SpawnColumn, GoalRow, GoalColumn;
+    uint32_t PlatformCount, PlatformOffset;
+    uint32_t HeightsOffset;
+};
+
+/* A board moving back and forth along z, between Low and High; see Platforms */
+struct LevelPlatform {
+    float X, Y;
+    float Start, Low, High, Speed;
+};
+
+// Every number finite and a path of some length; updatePlatforms() never leaves it otherwise
+bool platformValid (const LevelPlatform& p)
+{
+    return isfinite(p.X) && isfinite(p.Y) && isfinite(p.Start) && isfinite(p.Low) && isfinite(p.High) && isfinite(p.Speed)
+        && p.Low < p.High;
+}
+
+struct LevelInfo {
+    int SpawnRow, SpawnColumn;
+    int GoalRow, GoalColumn; // -1 when the level has no goal
+} levelInfo;
+
+string levelPath; // --level; see loadStartLevel()
+
+/* A level read from its text form */
+struct LevelText {
+    LevelInfo Info;
+    int Rows, Columns;
+    vector<unsigned char> Heights; // row-major
+    vector<LevelPlatform> Platforms;
+};
+
+// No goal is -1 -1; otherwise it has to be on the map, or the level cannot be won
+bool goalValid (const LevelInfo& info, int rows, int columns)
+{
+    if (info.GoalRow == -1 && info.GoalColumn == -1)
+        return true;
+    return info.GoalRow >= 0 && info.GoalColumn >= 0 && info.GoalRow < rows && info.GoalColumn < columns;
+}
+
+bool readLevelText (const char* path, LevelText& level)
+{
+    ifstream in(path);
+    if (!in) {
+        cerr << "Error: cannot open level " << path << endl;
+        return false;
+    }
+    level.Rows = level.Columns = 0;
+    level.Info.SpawnRow = level.Info.SpawnColumn = 0;
+    level.Info.GoalRow = level.Info.GoalColumn = -1;
+    level.Heights.clear();
+    level.Platforms.clear();
+
+    string word;
+    while (level.Heights.empty() && in >> word) {
+        if (word[0] == '#')
+            getline(in, word);
+        else if (word == "size")
+            in >> level.Rows >> level.Columns;
+        else if (word == "spawn")
+            in >> level.Info.SpawnRow >> level.Info.SpawnColumn;
+        else if (word == "goal")
+            in >> level.Info.GoalRow >> level.Info.GoalColumn;
+        else if (word == "platform") {
+            LevelPlatform platform;
+            in >> platform.X >> platform.Y >> platform.Start >> platform.Low >> platform.High >> platform.Speed;
+            if (in && !platformValid(platform)) {
+                cerr << "Error: " << path << ": a platform needs finite numbers and low below high" << endl;
+                return false;
+            }
+            level.Platforms.pb(platform);
+        }
+        else if (word == "heights") {
+            if (level.Rows <= 0 || level.Columns <= 0 || level.Rows > LEVEL_MAX_SIZE || level.Columns > LEVEL_MAX_SIZE) {
+                cerr << "Error: " << path << ": heights before a valid size, 1 to " << LEVEL_MAX_SIZE << " each way" << endl;
+                return false;
+            }
+            level.Heights.resize((size_t)level.Rows*level.Columns);
+            for (size_t i=0; i<level.Heights.size(); i++) {
+                int height;
+                if (!(in >> height) || height < 0 || height > 255) {
+                    cerr << "Error: " << path << ": expected " << level.Heights.size() << " heights from 0 to 255" << endl;
+                    return false;
+                }
+                level.Heights[i] = height;
+            }
+        }
+        else {
+            cerr << "Error: " << path << ": unknown keyword '" << word << "'" << endl;
+            return false;
+        }
+        if (!in) {
+            cerr << "Error: " << path << ": bad '" << word << "' line" << endl;
+            return false;
+        }
+    }
+    if (level.Heights.empty()) {
+        cerr << "Error: " << path << ": no heights" << endl;
+        return false;
+    }
+    while (in >> word) {
+        if (word[0] != '#') {
+            cerr << "Error: " << path << ": '" << word << "' after the last of the heights" << endl;
+            return false;
+        }
+        getline(in, word);
+    }
+    const LevelInfo& info = level.Info;
+    if (info.SpawnRow < 0 || info.SpawnColumn < 0 || info.SpawnRow >= level.Rows || info.SpawnColumn >= level.Columns) {
+        cerr << "Error: " << path << ": spawn is off the map" << endl;
+        return false;
+    }
+    if (!goalValid(info, level.Rows, level.Columns)) {
+        cerr << "Error: " << path << ": goal is off the map" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool writeLevelFile (const LevelText& level, const char* path)
+{
+    size_t chunkRows = (level.Rows + CHUNK_SIZE-1)/CHUNK_SIZE, chunkColumns = (level.Columns + CHUNK_SIZE-1)/CHUNK_SIZE;
+    vector<unsigned char> blocks(chunkRows*chunkColumns*CHUNK_SIZE*CHUNK_SIZE, 0);
+    for (int i=0; i<level.Rows; i++)
+        for (int j=0; j<level.Columns; j++) {
+            size_t block = (i/CHUNK_SIZE)*chunkColumns + j/CHUNK_SIZE;
+            blocks[(block*CHUNK_SIZE + i%CHUNK_SIZE)*CHUNK_SIZE + j%CHUNK_SIZE] = level.Heights[(size_t)i*level.Columns + j];
+        }
+
+    LevelFileHeader header;
+    memcpy(header.Magic, LEVEL_MAGIC, sizeof(header.Magic));
+    header.Version = LEVEL_VERSION;
+    header.Rows = level.Rows;
+    header.Columns = level.Columns;
+    header.ChunkSize = CHUNK_SIZE;
+    header.SpawnRow = level.Info.SpawnRow;
+    header.SpawnColumn = level.Info.SpawnColumn;
+    header.GoalRow = level.Info.GoalRow;
+    header.GoalColumn = level.Info.GoalColumn;
+    header.PlatformCount = level.Platforms.size();
+    header.PlatformOffset = sizeof(header);
+    header.HeightsOffset = header.PlatformOffset + header.PlatformCount*sizeof(LevelPlatform);
+
+    ofstream out(path, ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    if (!level.Platforms.empty())
+        out.write((const char*)&level.Platforms[0], level.Platforms.size()*sizeof(LevelPlatform));
+    out.write((const char*)&blocks[0], blocks.size());
+    if (!out) {
+        cerr << "Error: cannot write level " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Moving platforms. Each moves back and forth along z between the ends of
+   its path, Low and High, at its own speed, and turns at an end with a step
+   of PLATFORM_TURN. Position is where it is along the path, in the level
+   file's units; platformZ() turns it into a z. The fields are kept in arrays
+   of their own, padded to a multiple of four, so updatePlatforms() moves the
+   platforms four at a time.
+
+   Paths never change, so the platforms a player can be standing on are
+   looked up in a grid of buckets, each PLATFORM_BUCKET x PLATFORM_BUCKET
+   tiles, built once per level with every platform in each bucket its path
+   crosses. */
+const int PLATFORM_BUCKET = 4;
+const float PLATFORM_TURN = 0.05;
+const float PLATFORM_HALF = 0.2;   // half the width and depth of a platform
+const float PLATFORM_TOP = 0.05;   // from its center to its top
+const float PLATFORM_REACH = PLATFORM_HALF + 0.2; // from its center to a player over it
+
+struct Platforms {
+    int Count;
+    vector<float> X, Y;
+    vector<float> Low, High, Speed;
+    vector<float> Position;
+    vector<float> Previous;            // Position before the last tick, for drawing between ticks
+    vector<float> Direction;           // +1 or -1
+    int BucketRows, BucketColumns;
+    vector<int> BucketStart;           // bucket b holds BucketItems[BucketStart[b] .. BucketStart[b+1])
+    vector<int> BucketItems;
+} platforms;
+
+float platformZ (int i)
+{
+    return platforms.Position[i] - 4.7;
+}
+
+// Where platform i is drawn, a fraction alpha of the last tick on from where it was
+float platformDrawZ (int i, float alpha)
+{
+    return glm::mix(platforms.Previous[i], platforms.Position[i], alpha) - 4.7;
+}
+
+// The tile under a point of the world; the same tiles the world is drawn with
+int worldRowAt (float z)
+{
+    return (int)floor((0.2 - z)/0.4);
+}
+
+int worldColumnAt (float x)
+{
+    return (int)floor((x + 3.2)/0.4);
+}
+
+void loadPlatforms (const LevelPlatform* list, int count)
+{
+    Platforms& p = platforms;
+    p.Count = count;
+    int padded = (count + 3) & ~3;
+    p.X.assign(padded, 0);
+    p.Y.assign(padded, 0);
+    p.Low.assign(padded, 0);
+    p.High.assign(padded, 0);
+    p.Speed.assign(padded, 0);
+    p.Position.assign(padded, 0);
+    p.Direction.assign(padded, 1);
+    for (int i=0; i<count; i++) {
+        p.X[i] = list[i].X;
+        p.Y[i] = list[i].Y;
+        p.Low[i] = list[i].Low;
+        p.High[i] = list[i].High;
+        p.Speed[i] = list[i].Speed;
+        p.Position[i] = list[i].Start;
+    }
+    p.Previous = p.Position;
+
+    // The tiles a player over each path can be on, clamped to the map
+    vector<int> first(4*count);
+    for (int i=0; i<count; i++) {
+        int* box = &first[4*i];
+        float lowZ = min(p.Low[i], p.High[i]) - 4.7 - PLATFORM_TURN, highZ = max(p.Low[i], p.High[i]) - 4.7 + PLATFORM_TURN;
+        box[0] = max(0, worldRowAt(highZ + PLATFORM_REACH));
+        box[1] = min(tiles.Rows-1, worldRowAt(lowZ - PLATFORM_REACH));
+        box[2] = max(0, worldColumnAt(p.X[i] - PLATFORM_REACH));
+        box[3] = min(tiles.Columns-1, worldColumnAt(p.X[i] + PLATFORM_REACH));
+    }
+    p.BucketRows = (tiles.Rows + PLATFORM_BUCKET-1)/PLATFORM_BUCKET;
+    p.BucketColumns = (tiles.Columns + PLATFORM_BUCKET-1)/PLATFORM_BUCKET;
+    p.BucketStart.assign(p.BucketRows*p.BucketColumns + 1, 0);
+    for (int pass=0; pass<2; pass++) {
+        for (int i=0; i<count; i++) {
+            const int* box = &first[4*i];
+            if (box[0] > box[1] || box[2] > box[3])
+                continue;
+            for (int r=box[0]/PLATFORM_BUCKET; r<=box[1]/PLATFORM_BUCKET; r++)
+                for (int c=box[2]/PLATFORM_BUCKET; c<=box[3]/PLATFORM_BUCKET; c++) {
+                    int b = r*p.BucketColumns + c;
+                    if (pass == 0)
+                        p.BucketStart[b+1]++;
+                    else
+                        p.BucketItems[p.BucketStart[b]++] = i;
                 }
-                cout << vo_t << " " << ho_t << " ---" << endl;
-
-                // thread(play_audio,"Mario - Jump.mp3").detach();
-               ind=1;
-               ina=0;
-               inw=0;
-               ins=0;
-               if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9 && player_height==9)
-               {
-                // if(int(10*vo_t)%4==0 && int(10*ho_t)%4==0)
-                  ho_t-=0.2;
-               }
-               break;
+        }
+        if (pass == 0) {
+            for (size_t b=1; b<p.BucketStart.size(); b++)
+                p.BucketStart[b] += p.BucketStart[b-1];
+            p.BucketItems.resize(p.BucketStart.back());
+        }
+        else {
+            // Filling moved every start onto the next bucket's; move them back
+            for (size_t b=p.BucketStart.size()-1; b>0; b--)
+                p.BucketStart[b] = p.BucketStart[b-1];
+            p.BucketStart[0] = 0;
+        }
+    }
+}
+
+/* One frame of every platform: a step along its path, or the turn at its
+   end, rounded to hundredths as the board always was */
+void updatePlatforms ()
+{
+    Platforms& p = platforms;
+    int padded = p.Position.size();
+    p.Previous = p.Position;
+#ifdef __SSE2__
+    const __m128 turn = _mm_set1_ps(PLATFORM_TURN), hundred = _mm_set1_ps(100), half = _mm_set1_ps(0.5), one = _mm_set1_ps(1), sign = _mm_set1_ps(-0.0f);
+    for (int i=0; i<padded; i+=4) {
+        __m128 position = _mm_loadu_ps(&p.Position[i]), direction = _mm_loadu_ps(&p.Direction[i]);
+        __m128 inside = _mm_and_ps(_mm_cmpgt_ps(position, _mm_loadu_ps(&p.Low[i])), _mm_cmplt_ps(position, _mm_loadu_ps(&p.High[i])));
+        direction = _mm_xor_ps(direction, _mm_andnot_ps(inside, sign));
+        __m128 step = _mm_or_ps(_mm_and_ps(inside, _mm_loadu_ps(&p.Speed[i])), _mm_andnot_ps(inside, turn));
+        position = _mm_add_ps(position, _mm_mul_ps(step, direction));
+        // floor(position*100 + 0.5)/100; truncation, less one where it rounded up
+        __m128 scaled = _mm_add_ps(_mm_mul_ps(position, hundred), half);
+        __m128 rounded = _mm_cvtepi32_ps(_mm_cvttps_epi32(scaled));
+        rounded = _mm_sub_ps(rounded, _mm_and_ps(_mm_cmpgt_ps(rounded, scaled), one));
+        position = _mm_div_ps(rounded, hundred);
+        _mm_storeu_ps(&p.Position[i], position);
+        _mm_storeu_ps(&p.Direction[i], direction);
+    }
+#else
+    for (int i=0; i<padded; i++) {
+        bool inside = p.Position[i] > p.Low[i] && p.Position[i] < p.High[i];
+        if (!inside)
+            p.Direction[i] = -p.Direction[i];
+        float position = p.Position[i] + (inside ? p.Speed[i] : PLATFORM_TURN)*p.Direction[i];
+        p.Position[i] = floorf(position*100 + 0.5f)/100;
+    }
+#endif
+}
+
+/* The platform whose top a player at (x, z), with its center at height y,
+   stands over, or -1: the player's footprint, a tile wide, overlaps it */
+int platformUnder (float x, float z, float y)
+{
+    const Platforms& p = platforms;
+    int row = worldRowAt(z), column = worldColumnAt(x);
+    if (p.Count == 0 || row < 0 || column < 0 || row >= tiles.Rows || column >= tiles.Columns)
+        return -1;
+    int b = (row/PLATFORM_BUCKET)*p.BucketColumns + column/PLATFORM_BUCKET;
+    for (int k=p.BucketStart[b]; k<p.BucketStart[b+1]; k++) {
+        int i = p.BucketItems[k];
+        if (fabs(x - p.X[i]) < PLATFORM_REACH && fabs(z - platformZ(i)) < PLATFORM_REACH && y > p.Y[i] + PLATFORM_TOP)
+            return i;
+    }
+    return -1;
+}
+
+/* The platform the player rides, or -1. The player keeps its position on the
+   map while it rides and is drawn on the platform, carried along; jumping
+   off puts it on the map where the platform is. */
+int ridePlatform = -1;
+
+float rideOffset ()
+{
+    return ridePlatform < 0 ? 0 : platformZ(ridePlatform) - vo_t;
+}
+
+void leavePlatform ()
+{
+    if (ridePlatform < 0)
+        return;
+    placePlayer(playerPosition.X, playerPosition.Z - (int)floor(rideOffset()/0.2 + 0.5));
+    ridePlatform = -1;
+}
+
+/* The game advances in fixed ticks, TickRate a second (--tick-rate), however
+   often it is drawn: main() runs as many ticks as the time since the last
+   frame owes, and draw() places what moves between where it was before the
+   last tick and where it is now. A tick is what a frame used to be, so at
+   the default 60 the game plays as it always did under 60 Hz vsync. */
+struct Simulation {
+    double TickRate;
+    bool Vsync;                // --no-vsync draws as fast as it can
+    glm::vec3 Body, Stand;     // playerBody() and playerStand() before the last tick
+    long Ticks;                // since the level started
+    long WonAt;                // the first tick on the goal, or -1
+} simulation = { 60, true };
+
+// Where the player's body is, jump and ride included; each mesh adds its own offset
+glm::vec3 playerBody ()
+{
+    return glm::vec3(ho_t-3+(horizontal_position*toaddh), 5-((9-player_height)*0.4)+vertical_position, vo_t+(toaddv*z_position)+rideOffset());
+}
+
+// Where the player stands on the map, which the first-person cameras follow
+glm::vec3 playerStand ()
+{
+    return glm::vec3(ho_t-3, 5-((9-player_height)*0.4), vo_t);
+}
+
+// Before a tick, and by startLevel() so a new level is not drawn sliding in
+// from the last one; steps and landings, put by placePlayer(), are drawn as moves
+void keepPreviousState ()
+{
+    simulation.Body = playerBody();
+    simulation.Stand = playerStand();
+}
+
+vector<LevelPlatform> levelPlatforms; // where startLevel() put them; see restartLevel()
+
+/* Puts the player on the spawn column and the platforms at their starts */
+void startLevel (const LevelInfo& info, const LevelPlatform* list, int platformCount)
+{
+    levelInfo = info;
+    levelPlatforms.assign(list, list + platformCount);
+    placePlayer(2*info.SpawnColumn, 2*info.SpawnRow);
+    player_height = tileHeight(tiles, info.SpawnRow, info.SpawnColumn);
+    loadPlatforms(list, platformCount);
+    ridePlatform = -1;
+    simulation.Ticks = 0;
+    simulation.WonAt = -1;
+    keepPreviousState();
+}
+
+void loadLevelText (const LevelText& level)
+{
+    createWorld(level.Rows, level.Columns);
+    for (int i=0; i<level.Rows; i++)
+        for (int j=0; j<level.Columns; j++)
+            setWorldHeight(i, j, level.Heights[i*level.Columns + j]);
+    startLevel(level.Info, level.Platforms.empty() ? NULL : &level.Platforms[0], level.Platforms.size());
+}
+
+bool loadLevelFile (const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        cerr << "Error: cannot open level " << path << endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* mapping = size >= sizeof(LevelFileHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        cerr << "Error: " << path << " is not a level file" << endl;
+        return false;
+    }
+
+    const unsigned char* data = (const unsigned char*)mapping;
+    const LevelFileHeader& header = *(const LevelFileHeader*)data;
+    bool valid = memcmp(header.Magic, LEVEL_MAGIC, sizeof(header.Magic)) == 0 && header.Version == LEVEL_VERSION
+        && header.ChunkSize == CHUNK_SIZE && header.Rows > 0 && header.Columns > 0
+        && header.Rows <= LEVEL_MAX_SIZE && header.Columns <= LEVEL_MAX_SIZE;
+    // Only once the size is known to be in range; in 64 bits, so no size wraps
+    uint64_t chunkRows = valid ? ((uint64_t)header.Rows + CHUNK_SIZE-1)/CHUNK_SIZE : 0;
+    uint64_t chunkColumns = valid ? ((uint64_t)header.Columns + CHUNK_SIZE-1)/CHUNK_SIZE : 0;
+    valid = valid && header.PlatformOffset + (uint64_t)header.PlatformCount*sizeof(LevelPlatform) <= size
+        && header.HeightsOffset + chunkRows*chunkColumns*CHUNK_SIZE*CHUNK_SIZE <= size
+        && header.SpawnRow >= 0 && header.SpawnColumn >= 0 && header.SpawnRow < header.Rows && header.SpawnColumn < header.Columns;
+    LevelInfo level = { header.SpawnRow, header.SpawnColumn, header.GoalRow, header.GoalColumn };
+    valid = valid && goalValid(level, header.Rows, header.Columns);
+    if (!valid) {
+        cerr << "Error: " << path << " is not a version " << LEVEL_VERSION << " level file; re-import it" << endl;
+        munmap(mapping, size);
+        return false;
+    }
+    vector<LevelPlatform> list(header.PlatformCount);
+    if (!list.empty())
+        memcpy(&list[0], data + header.PlatformOffset, list.size()*sizeof(LevelPlatform));
+    for (size_t i=0; i<list.size(); i++)
+        if (!platformValid(list[i])) {
+            cerr << "Error: " << path << ": platform " << i << " has a non-finite number or low not below high" << endl;
+            munmap(mapping, size);
+            return false;
+        }
+
+    createWorld(header.Rows, header.Columns);
+    const unsigned char* blocks = data + header.HeightsOffset;
+    for (size_t n=0; n<world.Chunks.size(); n++) {
+        memcpy(world.Chunks[n].Heights, blocks + n*CHUNK_SIZE*CHUNK_SIZE, CHUNK_SIZE*CHUNK_SIZE);
+        world.Chunks[n].Dirty = true;
+    }
+    for (int i=0; i<header.Rows; i++)
+        for (int j=0; j<header.Columns; j++)
+            setTileHeight(tiles, i, j, worldHeight(i, j));
+    startLevel(level, list.empty() ? NULL : &list[0], list.size());
+    munmap(mapping, size);
+    return true;
+}
+
+/* The level named by --level, binary or .txt; by default levels/level1.lvl,
+   built by make, or else its text form */
+void loadStartLevel ()
+{
+    string path = levelPath.empty() ? "levels/level1.lvl" : levelPath;
+    bool text = path.size() > 4 && path.compare(path.size()-4, 4, ".txt") == 0;
+    if (levelPath.empty() && access(path.c_str(), R_OK) != 0) {
+        path = "levels/level1.txt";
+        text = true;
+    }
+    LevelText level;
+    if (text ? !readLevelText(path.c_str(), level) : !loadLevelFile(path.c_str()))
+        exit(EXIT_FAILURE);
+    if (text)
+        loadLevelText(level);
+}
+
+/* The player's controls, from the keyboard or a --simulate script: a step
+   one way along x (dx) or z (dz), which faces the player that way for the
+   next jump, and the jump */
+void stepInput (int dx, int dz)
+{
+    walkPlayer(dx, dz);
+    x_turn = dx != 0;
+    z_turn = dz != 0;
+    no_of_walks = 1;
+    if (player_eye == 1) {
+        dont_show = x_turn;
+        dont_show1 = z_turn;
+    }
+    ind = dx > 0;
+    ina = dx < 0;
+    inw = dz > 0;
+    ins = dz < 0;
+}
+
+void jumpInput ()
+{
+    jump_initiated = 1;
+    leavePlatform();
+}
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action == GLFW_RELEASE) {
+        switch (key) {
+            case GLFW_KEY_C:
+                rectangle_rot_status = !rectangle_rot_status;
+                break;
+            case GLFW_KEY_P:
+                triangle_rot_status = !triangle_rot_status;
+                break;
+            case GLFW_KEY_X:
+                // do something ..
+                break;
+            default:
+                break;
+        }
+    }
+    else if (action == GLFW_PRESS) {
+        switch (key) {
+            case GLFW_KEY_ESCAPE:
+                quit(window);
+                break;
+            case GLFW_KEY_LEFT:
+                stepInput(-1, 0);
+                break;
+            case GLFW_KEY_RIGHT:
+                stepInput(1, 0);
+                break;
             case GLFW_KEY_UP:
-                x_turn=0;
-          z_turn=1;
-          // temp=vo_t;
-          // if(arrow_work==0)
-            vo_t-=0.2;
-          vo_t = floor(vo_t*10);
-          cout << vo_t << endl;
-          vo_t=vo_t/10;
-          cout << ":::" << vo_t << endl;
-          no_of_walks=1;
-          if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9 && player_height==9)
-          {
-            // if(int(10*vo_t)%4==0 && int(10*ho_t)%4==0)
-              vo_t+=0.2;
-          }
-          // cout << vo_t << " " << ho_t << endl;
-          if(player_eye==1)
-          {
-            dont_show1=1;
-            dont_show=0;
-          }
-          // thread(play_audio,"Mario - Jump.mp3").detach(); 
-          ind=0;
-          ina=0;
-          inw=1;
-          ins=0;
-          break;
-          case GLFW_KEY_DOWN:
-            x_turn=0;
-          z_turn=1;
-          // if(arrow_work==0)
-            vo_t+=0.2;
-          // cout << vo_t*10 << endl;
-          vo_t = floor(vo_t*10);
-          if(int(-1*vo_t)%2==1)
-          {
-            vo_t+=1;
-            // cout << "----" << endl;
-          }
-          
-          vo_t=vo_t/10;
-          cout << vo_t << endl;
-          no_of_walks=1;
-          if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9  && player_height==9)
-            vo_t-=0.2;
-          if(player_eye==1)
-          {
-            dont_show1=1;
-            dont_show=0;
-          }
-          ind=0;
-          ina=0;
-          inw=0;
-          ins=1;
-          // thread(play_audio,"Mario - Jump.mp3").detach();
-          break;    
+                stepInput(0, 1);
+                break;
+            case GLFW_KEY_DOWN:
+                stepInput(0, -1);
+                break;
             default:
                 break;
         }
     }
 }
 
+void printRouteHint (); // with the route solver, below
+
 /* Executed for character input (like in text boxes) */
 void keyboardChar (GLFWwindow* window, unsigned int key)
 {
@@ -434,120 +2006,17 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
             quit(window);
             break;
         case 'a':
-        // case 37:
-        	// if(arrow_work==0)
-        		ho_t-=0.2;
-        	x_turn=1;
-        	z_turn=0;
-        	ho_t = floor(ho_t*10);
-        	ho_t=ho_t/10;
-          no_of_walks=1;
-          if(player_eye==1)
-          {
-            dont_show=1;
-            dont_show1=0;
-          }
-          ind=0;
-          ina=1;
-          inw=0;
-          ins=0;
-          // thread(play_audio,"Mario - Jump.mp3").detach();
-          // play_audio("jump_01.mp3");
-          // cout << ho_t << " " << vo_t << endl;
-          if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9 && player_height==9)
-            ho_t+=0.2;
-          if(test[-1*int(vo_t*10)/4+1][int(ho_t*10)/4]>9 && player_height==9 && int(vo_t*10)%4!=0)
-          {
-            ho_t-=0.2;
-          }
-          // cout << ho_t << " " << vo_t << endl;
-        	break;
+          stepInput(-1, 0);
+          break;
         case 'd':
-        	x_turn=1;
-        	z_turn=0;
-        	// if(arrow_work==0)
-        		ho_t+=0.2;
-        	ho_t = floor(ho_t*10);
-        	ho_t=ho_t/10;
-          no_of_walks=1;
-          if(player_eye==1)
-          {
-            dont_show=1;
-            dont_show1=0;
-          }
-          cout << vo_t << " " << ho_t << " ---" << endl;
-          // thread(play_audio,"Mario - Jump.mp3").detach();
-          ind=1;
-          ina=0;
-          inw=0;
-          ins=0;
-          if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9 && player_height==9)
-          {
-            // if(int(10*vo_t)%4==0 && int(10*ho_t)%4==0)
-              ho_t-=0.2;
-          }
-          if(test[-1*int(vo_t*10)/4+1][int(ho_t*10)/4]>9 && player_height==9 && int(vo_t*10)%4!=0)
-          {
-            ho_t-=0.2;
-          }
-        	break;
+          stepInput(1, 0);
+          break;
         case 'w':
-        	x_turn=0;
-        	z_turn=1;
-          // temp=vo_t;
-        	// if(arrow_work==0)
-        		vo_t-=0.2;
-        	vo_t = floor(vo_t*10);
-          cout << vo_t << endl;
-        	vo_t=vo_t/10;
-          cout << ":::" << vo_t << endl;
-          no_of_walks=1;
-          if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9 && player_height==9)
-          {
-            // if(int(10*vo_t)%4==0 && int(10*ho_t)%4==0)
-              vo_t+=0.2;
-          }
-          // cout << vo_t << " " << ho_t << endl;
-          if(player_eye==1)
-          {
-            dont_show1=1;
-            dont_show=0;
-          }
-          // thread(play_audio,"Mario - Jump.mp3").detach(); 
-          ind=0;
-          ina=0;
-          inw=1;
-          ins=0;
-        	break;
+          stepInput(0, 1);
+          break;
         case 's':
-        	x_turn=0;
-        	z_turn=1;
-        	// if(arrow_work==0)
-        		vo_t+=0.2;
-          // cout << vo_t*10 << endl;
-        	vo_t = floor(vo_t*10);
-          if(int(-1*vo_t)%2==1)
-          {
-            vo_t+=1;
-            // cout << "----" << endl;
-          }
-          
-        	vo_t=vo_t/10;
-          cout << vo_t << endl;
-          no_of_walks=1;
-          if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9  && player_height==9)
-            vo_t-=0.2;
-          if(player_eye==1)
-          {
-            dont_show1=1;
-            dont_show=0;
-          }
-          ind=0;
-          ina=0;
-          inw=0;
-          ins=1;
-          // thread(play_audio,"Mario - Jump.mp3").detach();
-        	break;
+          stepInput(0, -1);
+          break;
         case 'r':
           // x++;
           rotate_build = 1;
@@ -606,17 +2075,11 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
           dont_show=0;
           dont_show1=0;
           break;
+        case 'h':
+          printRouteHint();
+          break;
         case ' ':
-          jump_initiated =1;
-          if(onboard==1)
-          {
-            storeinitialposition=forboardmovement;
-            if((board_position-4.7)<-1.8)
-            {
-              work=1;
-            }
-            cout << board_position-4.7 << "  @@@@@@@@@"  << endl;
-          }
+          jumpInput();
 
 		default:
 			break;
@@ -675,12 +2138,13 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     int fbwidth=width, fbheight=height;
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
      is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    if (window != NULL) // NULL in headless mode, the offscreen framebuffer has the requested size
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
 	// GLfloat fov = 90.0f;
     GLfloat fov = 0.2f;
 	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	stateViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
 
 	// set the projection matrix as perspective
 	/* glMatrixMode (GL_PROJECTION);
@@ -694,7 +2158,8 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     // Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
 }
 
-VAO *triangle, *rectangle ,*trans, *forplayer, *body, *body_x, *arrow1, *arrow2, *arrow3, *arrow4 , *small_cube, *board, *plane;
+VAO *triangle, *forplayer, *arrow1, *arrow2, *arrow3, *arrow4 , *small_cube;
+DynamicMesh body, body_x, board; // move every frame, streamed
 
 // Creates the triangle object used in this sample code
 VAO* createTriangle (float x,float y,float z,float w)
@@ -712,7 +2177,8 @@ VAO* createTriangle (float x,float y,float z,float w)
   return create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
 
-VAO createPlane()
+// Triangle list of the floor
+DynamicMesh planeMesh()
 {
   static const GLfloat vertex_buffer_data [] = {
     165,0,0, // vertex 0
@@ -730,11 +2196,14 @@ VAO createPlane()
     0/255.0,128/255.0,255/255.0,
     0/255.0,128/255.0,255/255.0,
   };
-  plane = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL); 
+  DynamicMesh mesh;
+  mesh.Positions.assign(vertex_buffer_data, vertex_buffer_data + 3*6);
+  mesh.Colors.assign(color_buffer_data, color_buffer_data + 3*6);
+  return mesh;
 }
 
-// Creates the rectangle object used in this sample code
-VAO* createRectangle (float x,float y,float z,GLenum fill_mode=GL_FILL)
+// Triangle list of the box used in this sample code, before any welding
+DynamicMesh rectangleMesh (float x,float y,float z)
 {
   // GL3 accepts only Triangles. Quads are not supported
   GLfloat vertex_buffer_data [] = {
@@ -838,155 +2307,1182 @@ VAO* createRectangle (float x,float y,float z,GLenum fill_mode=GL_FILL)
     1,1,1,
   };
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  return create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data,fill_mode);
+  DynamicMesh mesh;
+  mesh.Positions.assign(vertex_buffer_data, vertex_buffer_data + 3*36);
+  mesh.Colors.assign(color_buffer_data, color_buffer_data + 3*36);
+  return mesh;
 }
 
+// Creates the rectangle object used in this sample code
+VAO* createRectangle (float x,float y,float z,GLenum fill_mode=GL_FILL)
+{
+  DynamicMesh box = rectangleMesh(x, y, z);
 
-float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
-float triangle_rotation = 0;
-
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
+  // The 36 listed vertices share corners; weld them and draw indexed
+  MeshBuilder mesh;
+  addVertices(mesh, 36, &box.Positions[0], &box.Colors[0]);
+  return create3DObjectIndexed(GL_TRIANGLES, mesh, fill_mode);
+}
 
-float jump(float horizontal_position)
+// Records the level's static scenery that is not part of the world grid: the floor
+void recordStaticScene ()
 {
-  horizontal_position += initial_velocity*cos(angle_thrown)*0.005;
-  vertical_position += initial_velocity*sin(angle_thrown)*0.005 - (time_travel*time_travel);
-  time_travel +=0.01;
-  return horizontal_position;
+  clearStaticScene();
+  addStaticPart(planeMesh(), vector<glm::vec3>(1, glm::vec3(-68,-10,60)), GL_FILL);
 }
 
-void draw_cube(VAO *obj,float x_pos,float y_pos,float z_pos)
+VAO *cube; // shared by every chunk's instanced views
+
+// Cube k of column (i,j) is filled on even levels up to 9, a wireframe otherwise
+bool filledLevel (int k)
 {
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-  glm::mat4 MVP;
-  Matrices.model = glm::mat4(1.0f);
+  return k%2==0 && k<=9;
+}
 
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(x_pos, y_pos, z_pos));        // glTranslatef
-  // glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(1,1,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+// Faces of a grid cube, as mask bits. Front faces +z, toward row i-1.
+enum CubeFace {
+  FACE_LEFT = 1, FACE_RIGHT = 2,  // -x, +x
+  FACE_BOTTOM = 4, FACE_TOP = 8,  // -y, +y
+  FACE_FRONT = 16, FACE_BACK = 32 // +z, -z
+};
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(obj);
+// Only filled cubes hide what is behind them; wireframes are seen through
+bool opaqueCube (int i, int j, int k)
+{
+  return k >= 0 && filledLevel(k) && worldHeight(i, j) > k;
 }
 
-void draw_cuboid(VAO *obj,float x_pos,float y_pos,float z_pos,int flag,int x_walk,int z_walk)
+// Meshing stage: the faces of cube (i,j,k) that no opaque neighbor covers.
+// Works across chunk borders, since it reads the whole world.
+int exposedFaces (int i, int j, int k)
 {
-	glm::mat4 VP = Matrices.projection * Matrices.view;
- 	glm::mat4 MVP;
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(x_pos, y_pos, z_pos));
-  glm::mat4 translateRectangle1 = glm::translate (glm::vec3(0, 0.2, 0));
-  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(0, -0.2, 0));
-  glm::mat4 rotateRectangle = glm::rotate((float)(flag*rectangle_rotation*M_PI/180.0f), glm::vec3(z_walk,0,x_walk));
-  if(no_of_walks!=0)
+  int faces = 0;
+  if(!opaqueCube(i, j-1, k)) faces |= FACE_LEFT;
+  if(!opaqueCube(i, j+1, k)) faces |= FACE_RIGHT;
+  if(!opaqueCube(i, j, k-1)) faces |= FACE_BOTTOM;
+  if(!opaqueCube(i, j, k+1)) faces |= FACE_TOP;
+  if(!opaqueCube(i-1, j, k)) faces |= FACE_FRONT;
+  if(!opaqueCube(i+1, j, k)) faces |= FACE_BACK;
+  return faces;
+}
+
+// Exposed faces of every cube on level k of a chunk, 0 where there is no cube
+void chunkFaceMasks (const WorldChunk& chunk, int chunkRow, int chunkColumn, int k, unsigned char masks[CHUNK_SIZE][CHUNK_SIZE])
+{
+  for(int r=0;r<CHUNK_SIZE;r++)
+    for(int c=0;c<CHUNK_SIZE;c++)
+      masks[r][c] = chunk.Heights[r][c] > k ? exposedFaces(chunkRow*CHUNK_SIZE + r, chunkColumn*CHUNK_SIZE + c, k) : 0;
+}
+
+// Corner of the world grid: x grows with the column j, y with the level k, z falls with the row i
+glm::vec3 gridCorner (int i, int j, int k)
+{
+  return glm::vec3(-3.2+j*0.4, 1.2+k*0.4, 0.4-i*0.4);
+}
+
+// Adds the quad a,b,c,d (in order around it) as two triangles
+void addQuad (MeshBuilder& mesh, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, const glm::vec3& d, const GLfloat* color)
+{
+  const glm::vec3* corners[] = { &a, &b, &c, &c, &d, &a };
+  for(int v=0;v<6;v++)
+    addVertex(mesh, &(*corners[v])[0], color);
+}
+
+// Greedy mesher for the filled cubes of one chunk. Filled cubes are never
+// stacked directly (they alternate with wireframes), so each level is meshed
+// on its own, and only faces left exposed by chunkFaceMasks() are emitted:
+// top faces merge into rectangles across rows and columns, side faces into
+// runs along a row or column. Faces keep the cube's colors; the bottom face
+// has per-vertex colors and so stays one quad per cube. Every filled cube
+// shows its top, so the top rectangles, as boxes, also make the occluders.
+void greedyMeshFilled (MeshBuilder& mesh, vector<OccluderBox>& occluders, const WorldChunk& chunk, int chunkRow, int chunkColumn)
+{
+  static const GLfloat top[] = { 1, 1, 1 }, back[] = { 152/255.0, 205/255.0, 152/255.0 }, front[] = { 0, 1, 0 };
+  static const GLfloat right[] = { 0, 0, 1 }, left[] = { 1, 0, 0 };
+  static const DynamicMesh box = rectangleMesh(0.2,0.2,0.2);
+  int i0 = chunkRow*CHUNK_SIZE, j0 = chunkColumn*CHUNK_SIZE;
+
+  for(int k=0;k<=9;k++)
   {
-    Matrices.model *= (translateRectangle * translateRectangle1 * rotateRectangle * translateRectangle2);
+    if(!filledLevel(k))
+      continue;
+    unsigned char faces[CHUNK_SIZE][CHUNK_SIZE];
+    chunkFaceMasks(chunk, chunkRow, chunkColumn, k, faces);
+    bool used[CHUNK_SIZE][CHUNK_SIZE];
+    memset(used, 0, sizeof(used));
+
+    // Top faces: grow a run along the row, then extend it over the following rows
+    for(int r=0;r<CHUNK_SIZE;r++)
+      for(int c=0;c<CHUNK_SIZE;c++)
+      {
+        if(!(faces[r][c] & FACE_TOP) || used[r][c])
+          continue;
+        int w = 1, h = 1;
+        while(c+w<CHUNK_SIZE && (faces[r][c+w] & FACE_TOP) && !used[r][c+w])
+          w++;
+        for(bool grow=true; grow && r+h<CHUNK_SIZE; )
+        {
+          for(int x=c;x<c+w && grow;x++)
+            grow = (faces[r+h][x] & FACE_TOP) && !used[r+h][x];
+          if(grow)
+            h++;
+        }
+        for(int y=r;y<r+h;y++)
+          for(int x=c;x<c+w;x++)
+            used[y][x] = true;
+        int i = i0+r, j = j0+c;
+        addQuad(mesh, gridCorner(i,j,k+1), gridCorner(i,j+w,k+1), gridCorner(i+h,j+w,k+1), gridCorner(i+h,j,k+1), top);
+        OccluderBox occluder = { gridCorner(i+h,j,k), gridCorner(i,j+w,k+1) };
+        occluders.pb(occluder);
+      }
+
+    // Faces across a row (front and back), merged along it
+    for(int r=0;r<CHUNK_SIZE;r++)
+      for(int side=0;side<2;side++)
+      {
+        int face = side ? FACE_BACK : FACE_FRONT;
+        for(int c=0;c<CHUNK_SIZE;)
+        {
+          if(!(faces[r][c] & face)) { c++; continue; }
+          int w = 1;
+          while(c+w<CHUNK_SIZE && (faces[r][c+w] & face))
+            w++;
+          int i = i0+r+side, j = j0+c; // the back face lies on the next row's corner line
+          addQuad(mesh, gridCorner(i,j,k), gridCorner(i,j+w,k), gridCorner(i,j+w,k+1), gridCorner(i,j,k+1), side ? back : front);
+          c += w;
+        }
+      }
+
+    // Faces across a column (left and right), merged along it
+    for(int c=0;c<CHUNK_SIZE;c++)
+      for(int side=0;side<2;side++)
+      {
+        int face = side ? FACE_RIGHT : FACE_LEFT;
+        for(int r=0;r<CHUNK_SIZE;)
+        {
+          if(!(faces[r][c] & face)) { r++; continue; }
+          int h = 1;
+          while(r+h<CHUNK_SIZE && (faces[r+h][c] & face))
+            h++;
+          int i = i0+r, j = j0+c+side;
+          addQuad(mesh, gridCorner(i,j,k), gridCorner(i+h,j,k), gridCorner(i+h,j,k+1), gridCorner(i,j,k+1), side ? right : left);
+          r += h;
+        }
+      }
+
+    // Bottom faces, as in the cube mesh
+    for(int r=0;r<CHUNK_SIZE;r++)
+      for(int c=0;c<CHUNK_SIZE;c++)
+        if(faces[r][c] & FACE_BOTTOM)
+        {
+          glm::vec3 offset(-3+(j0+c)*0.4, -2+k*0.4+3.4, -(i0+r)*0.4);
+          for(int v=30;v<36;v++)
+          {
+            glm::vec3 position = offset + glm::vec3(box.Positions[3*v], box.Positions[3*v+1], box.Positions[3*v+2]);
+            addVertex(mesh, &position[0], &box.Colors[3*v]);
+          }
+        }
   }
-  else
+}
+
+// Rebuilds one chunk: the greedy mesh of its filled cubes, and one instance
+// offset per wireframe cube (merging those would change which edges show)
+void meshChunk (int chunkRow, int chunkColumn)
+{
+  WorldChunk& chunk = world.Chunks[chunkRow*world.ChunkColumns + chunkColumn];
+  MeshBuilder filled;
+  vector<OccluderBox>& occluders = world.Occluders[chunkRow*world.ChunkColumns + chunkColumn];
+  occluders.clear();
+  greedyMeshFilled(filled, occluders, chunk, chunkRow, chunkColumn);
+
+  vector<glm::vec3> wire;
+  for(int r=0;r<CHUNK_SIZE;r++)
   {
-      Matrices.model *= (translateRectangle);
+    for(int c=0;c<CHUNK_SIZE;c++)
+    {
+      int i = chunkRow*CHUNK_SIZE + r, j = chunkColumn*CHUNK_SIZE + c;
+      for(int k=0;k<chunk.Heights[r][c];k++)
+      {
+        if(!filledLevel(k))
+          wire.pb(glm::vec3(-3+j*0.4,-2+k*0.4+3.4,-i*0.4));
+      }
+    }
   }
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(obj);
+
+  // Only this chunk's buffers are re-uploaded
+  if(chunk.Filled != NULL)
+    delete3DObject(chunk.Filled);
+  chunk.Filled = filled.Indices.empty() ? NULL : create3DObjectIndexed(GL_TRIANGLES, filled, GL_FILL);
+  if(chunk.Wire == NULL && !wire.empty())
+    chunk.Wire = createInstancedView(cube, GL_LINE);
+  if(chunk.Wire != NULL)
+    setInstanceOffsets(chunk.Wire, wire);
+  chunk.MaxHeight = 0;
+  for(int r=0;r<CHUNK_SIZE;r++)
+    for(int c=0;c<CHUNK_SIZE;c++)
+      chunk.MaxHeight = max(chunk.MaxHeight, (int)chunk.Heights[r][c]);
+  chunk.Dirty = false;
 }
 
+// Re-meshes the chunks whose heights changed since the last frame
+void updateWorldMeshes ()
+{
+  for(size_t i=0;i<retiredChunkMeshes.size();i++)
+    delete3DObject(retiredChunkMeshes[i]);
+  retiredChunkMeshes.clear();
+
+  world.Remeshed = 0;
+  for(int i=0;i<world.ChunkRows;i++)
+    for(int j=0;j<world.ChunkColumns;j++)
+      if(world.Chunks[i*world.ChunkColumns + j].Dirty)
+      {
+        meshChunk(i, j);
+        world.Remeshed++;
+      }
+}
 
-double GetFloatPrecision(double value, double precision)
+void printOcclusionCounters (); // with the occlusion culler, below
+
+// What frustum culling of the world did, summed over all frames
+struct CullingStats {
+  unsigned long Frames;
+  unsigned long ChunksTested, ChunksInside, ChunksCulled; // the rest straddle a plane
+  unsigned long ColumnsTested, ChunksCulledByColumns;     // straddling chunks with no visible column
+} cullingStats;
+
+void printCullingCounters ()
 {
-    return (floor((value * pow(10, precision) + 0.5)) / pow(10, precision)); 
+  const CullingStats& c = cullingStats;
+  if(c.Frames == 0)
+    return;
+  printf("Frustum culling per frame: %.1f chunks tested, %.1f fully inside, %.1f culled by their box, %.1f more by their columns (%.1f columns tested)\n",
+         (double)c.ChunksTested/c.Frames, (double)c.ChunksInside/c.Frames, (double)c.ChunksCulled/c.Frames,
+         (double)c.ChunksCulledByColumns/c.Frames, (double)c.ColumnsTested/c.Frames);
+  printOcclusionCounters();
 }
 
+// Hierarchical visibility of a chunk: its box first, and only when that
+// straddles the frustum, the boxes of its columns (which leave out the air
+// above short columns)
+bool chunkVisible (const Frustum& frustum, int chunkRow, int chunkColumn)
+{
+  const WorldChunk& chunk = world.Chunks[chunkRow*world.ChunkColumns + chunkColumn];
+  int i0 = chunkRow*CHUNK_SIZE, j0 = chunkColumn*CHUNK_SIZE;
+  cullingStats.ChunksTested++;
+  FrustumTest test = testBox(frustum, gridCorner(i0+CHUNK_SIZE, j0, 0), gridCorner(i0, j0+CHUNK_SIZE, chunk.MaxHeight));
+  if(test == FRUSTUM_OUTSIDE)
+  {
+    cullingStats.ChunksCulled++;
+    return false;
+  }
+  if(test == FRUSTUM_INSIDE)
+  {
+    cullingStats.ChunksInside++;
+    return true;
+  }
+  for(int r=0;r<CHUNK_SIZE;r++)
+    for(int c=0;c<CHUNK_SIZE;c++)
+    {
+      if(chunk.Heights[r][c] == 0)
+        continue;
+      cullingStats.ColumnsTested++;
+      if(testBox(frustum, gridCorner(i0+r+1, j0+c, 0), gridCorner(i0+r, j0+c+1, chunk.Heights[r][c])) != FRUSTUM_OUTSIDE)
+        return true;
+    }
+  cullingStats.ChunksCulledByColumns++;
+  return false;
+}
+
+/* Software occlusion culling. A worker thread rasterizes the filled cubes of
+   the chunks in the frustum into a small depth buffer, then tests the boxes
+   of those chunks, and of their columns, against it. It works one frame
+   ahead of the renderer: submitWorld() hands it this frame's camera and
+   applies its answer on the next frame only, so a chunk coming out from behind
+   a tower can stay hidden for that one frame. An answer that comes back later,
+   because the worker fell behind, is dropped and that frame draws everything.
+   Wireframe cubes are see-through and never occlude. */
+const int OCCLUSION_WIDTH = 128, OCCLUSION_HEIGHT = 128; // the width a multiple of 4
+
+// A chunk to test, copied so the worker never reads the live world
+struct OcclusionChunk {
+  int Index, Row0, Column0, MaxHeight;
+  unsigned char Heights[CHUNK_SIZE][CHUNK_SIZE];
+};
 
-void draw ()
+struct OcclusionCuller {
+  std::thread Worker;
+  std::mutex Lock;
+  std::condition_variable Wake;
+  bool Started, Busy, Ready, Quit; // Busy: the worker owns the job below
+
+  // The job: filled by submitWorld() while the worker is idle
+  glm::mat4 VP;
+  vector<OccluderBox> Occluders;
+  vector<OcclusionChunk> Chunks;
+  vector<int> Hidden;              // result: indices of chunks hidden behind the occluders
+  unsigned long OccludersDrawn, ColumnsTested;
+
+  vector<unsigned char> ChunkHidden; // per world chunk, from last frame's job; empty for none
+  long Frame, JobFrame;              // frames seen, and the one the job was posted in (-1: forgotten)
+  float Depth[OCCLUSION_HEIGHT][OCCLUSION_WIDTH]; // NDC depth of the nearest occluder
+
+  // Summed over all frames
+  unsigned long Jobs, JobsSkipped, Results, ResultsDropped, ChunksTested, ChunksHidden, TotalOccluders, TotalColumns;
+} occlusion;
+
+// Screen positions (in depth buffer pixels) and NDC depths of a box's corners;
+// false when a corner lies behind the near plane
+bool projectOcclusionBox (const glm::mat4& VP, const glm::vec3& lo, const glm::vec3& hi, glm::vec3 corners[8])
 {
-	
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  for(int c=0;c<8;c++)
+  {
+    glm::vec4 p = VP * glm::vec4(c&1 ? hi.x : lo.x, c&2 ? hi.y : lo.y, c&4 ? hi.z : lo.z, 1.0f);
+    if(p.w < 0.1f)
+      return false;
+    corners[c] = glm::vec3((p.x/p.w*0.5f + 0.5f)*OCCLUSION_WIDTH, (p.y/p.w*0.5f + 0.5f)*OCCLUSION_HEIGHT, p.z/p.w);
+  }
+  return true;
+}
 
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
+// Keeps the nearer depth in every pixel the triangle covers whole. A pixel
+// gets the triangle's farthest depth inside it, so the buffer never claims
+// more than the occluder hides.
+void rasterizeOccluderTriangle (glm::vec3 v0, glm::vec3 v1, glm::vec3 v2)
+{
+  float area = (v1.x-v0.x)*(v2.y-v0.y) - (v1.y-v0.y)*(v2.x-v0.x);
+  if(fabs(area) < 1e-6f)
+    return;
+  if(area < 0)
+  {
+    swap(v1, v2);
+    area = -area;
+  }
+  int x0 = max(0, (int)floor(min(v0.x, min(v1.x, v2.x)))) & ~3;
+  int x1 = min(OCCLUSION_WIDTH-1, (int)ceil(max(v0.x, max(v1.x, v2.x))));
+  int y0 = max(0, (int)floor(min(v0.y, min(v1.y, v2.y))));
+  int y1 = min(OCCLUSION_HEIGHT-1, (int)ceil(max(v0.y, max(v1.y, v2.y))));
+  if(x0 > x1 || y0 > y1)
+    return;
+
+  // Edge functions, each positive inside and zero on the edge opposite its vertex;
+  // the depth is their weighted sum. Both are taken at pixel centers, then
+  // moved to the pixel's worst corner: the edges in by half a pixel, the depth back.
+  const glm::vec3* v[3] = { &v0, &v1, &v2 };
+  float dx[3], dy[3], e[3];
+  for(int n=0;n<3;n++)
+  {
+    const glm::vec3& a = *v[(n+1)%3];
+    const glm::vec3& b = *v[(n+2)%3];
+    dx[n] = a.y - b.y;
+    dy[n] = b.x - a.x;
+    e[n] = a.x*b.y - a.y*b.x + dx[n]*(x0+0.5f) + dy[n]*(y0+0.5f);
+  }
+  float dzdx = (dx[0]*v0.z + dx[1]*v1.z + dx[2]*v2.z)/area;
+  float dzdy = (dy[0]*v0.z + dy[1]*v1.z + dy[2]*v2.z)/area;
+  float z = (e[0]*v0.z + e[1]*v1.z + e[2]*v2.z)/area + 0.5f*(fabs(dzdx) + fabs(dzdy));
+  for(int n=0;n<3;n++)
+    e[n] -= 0.5f*(fabs(dx[n]) + fabs(dy[n]));
 
-  // Eye - Location of camera. Don't change unless you are sure!!
-  //glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  glm::vec3 target (0, 0, 0);
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  glm::vec3 up (0, 1, 0);
+  for(int y=y0;y<=y1;y++)
+  {
+    float* row = occlusion.Depth[y];
+#ifdef __SSE2__
+    __m128 lanes = _mm_set_ps(3, 2, 1, 0);
+    __m128 w0 = _mm_add_ps(_mm_set1_ps(e[0]), _mm_mul_ps(lanes, _mm_set1_ps(dx[0])));
+    __m128 w1 = _mm_add_ps(_mm_set1_ps(e[1]), _mm_mul_ps(lanes, _mm_set1_ps(dx[1])));
+    __m128 w2 = _mm_add_ps(_mm_set1_ps(e[2]), _mm_mul_ps(lanes, _mm_set1_ps(dx[2])));
+    __m128 depth = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(lanes, _mm_set1_ps(dzdx)));
+    __m128 step0 = _mm_set1_ps(4*dx[0]), step1 = _mm_set1_ps(4*dx[1]), step2 = _mm_set1_ps(4*dx[2]), stepz = _mm_set1_ps(4*dzdx);
+    for(int x=x0;x<=x1;x+=4)
+    {
+      // A lane is outside when any edge function is negative: its sign bit is set
+      __m128 outside = _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(_mm_or_ps(w0, _mm_or_ps(w1, w2))), 31));
+      __m128 old = _mm_loadu_ps(row + x);
+      __m128 nearer = _mm_min_ps(old, depth);
+      _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(outside, old), _mm_andnot_ps(outside, nearer)));
+      w0 = _mm_add_ps(w0, step0); w1 = _mm_add_ps(w1, step1); w2 = _mm_add_ps(w2, step2);
+      depth = _mm_add_ps(depth, stepz);
+    }
+#else
+    for(int x=x0;x<=x1;x++)
+    {
+      float w0 = e[0] + (x-x0)*dx[0], w1 = e[1] + (x-x0)*dx[1], w2 = e[2] + (x-x0)*dx[2];
+      if(w0 >= 0 && w1 >= 0 && w2 >= 0)
+        row[x] = min(row[x], z + (x-x0)*dzdx);
+    }
+#endif
+    for(int n=0;n<3;n++)
+      e[n] += dy[n];
+    z += dzdy;
+  }
+}
 
-  
-  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-  //  Don't change unless you are sure!!
-  if(only_player==0 && top_view==0 && player_eye==0)
-    Matrices.view = glm::lookAt(glm::vec3(0+x+shiftx,20+y+shifty,0+z), glm::vec3(-1,3+0,-1.8), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  else if(only_player==1)
-    Matrices.view = glm::lookAt(glm::vec3(0+x1+shiftx,y+shifty,z1), glm::vec3(-2.9+ho_t-0.1+(horizontal_position*toaddh),5-((9-player_height)*0.4)+vertical_position,vo_t+0.8-0.6+(z_position*toaddv)), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  else if(top_view==1)
-    Matrices.view = glm::lookAt(glm::vec3(0,30,0), glm::vec3(-1,3+0,-1.8), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  else
+void rasterizeOccluder (const OccluderBox& box)
+{
+  static const int faces[6][4] = { {0,2,6,4}, {1,3,7,5}, {0,1,5,4}, {2,3,7,6}, {0,1,3,2}, {4,5,7,6} };
+  glm::vec3 corners[8];
+  if(!projectOcclusionBox(occlusion.VP, box.Lo, box.Hi, corners))
+    return;
+  occlusion.OccludersDrawn++;
+  for(int f=0;f<6;f++)
   {
-    if(inw==1)
-      Matrices.view = glm::lookAt(glm::vec3(-2.9+ho_t-0.1,5-((9-player_height)*0.4)-0.1,vo_t+0.2), glm::vec3(-2,-2+y,-80), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-    if(ins==1)
-      Matrices.view = glm::lookAt(glm::vec3(-2.9+ho_t-0.1,5-((9-player_height)*0.4)-0.1,vo_t+0.3), glm::vec3(-2,-2+y,80), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+    rasterizeOccluderTriangle(corners[faces[f][0]], corners[faces[f][1]], corners[faces[f][2]]);
+    rasterizeOccluderTriangle(corners[faces[f][0]], corners[faces[f][2]], corners[faces[f][3]]);
+  }
+}
 
-    if(ind==1)
-      Matrices.view = glm::lookAt(glm::vec3(-2.9+ho_t-0.1-1,5-((9-player_height)*0.4),vo_t+0.8-0.6-0.1), glm::vec3(40,y+5-((9-player_height)*0.4)-3,1), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-    if(ina==1)
-      Matrices.view = glm::lookAt(glm::vec3(-2.9+ho_t-0.1-1,2+5-((9-player_height)*0.4),vo_t+0.8-0.6-0.1), glm::vec3(-40,y+5-((9-player_height)*0.4)-3,1), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-    // dont_show=1;
+// True when every pixel the box covers holds an occluder nearer than all of the box
+bool occlusionBoxHidden (const glm::vec3& lo, const glm::vec3& hi)
+{
+  glm::vec3 corners[8];
+  if(!projectOcclusionBox(occlusion.VP, lo, hi, corners))
+    return false;
+  glm::vec3 low = corners[0], high = corners[0];
+  for(int c=1;c<8;c++)
+  {
+    low = glm::min(low, corners[c]);
+    high = glm::max(high, corners[c]);
   }
-  // 200,5+y,-00
+  int x0 = max(0, (int)floor(low.x)), x1 = min(OCCLUSION_WIDTH-1, (int)floor(high.x));
+  int y0 = max(0, (int)floor(low.y)), y1 = min(OCCLUSION_HEIGHT-1, (int)floor(high.y));
+  if(x0 > x1 || y0 > y1)
+    return false; // off the buffer: the frustum test has the last word
+  for(int y=y0;y<=y1;y++)
+  {
+    const float* row = occlusion.Depth[y];
+#ifdef __SSE2__
+    __m128 nearest = _mm_set1_ps(low.z);
+    for(int x=x0&~3;x<=x1;x+=4)
+    {
+      int first = max(0, x0-x), last = min(3, x1-x);
+      int lanes = ((1 << (last+1)) - 1) & ~((1 << first) - 1);
+      if(_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row + x), nearest)) & lanes)
+        return false;
+    }
+#else
+    for(int x=x0;x<=x1;x++)
+      if(row[x] >= low.z)
+        return false;
+#endif
+  }
+  return true;
+}
+
+// The worker's job: draw every occluder, then test each chunk's box and,
+// when that shows, its columns
+void runOcclusionJob ()
+{
+  for(int y=0;y<OCCLUSION_HEIGHT;y++)
+    for(int x=0;x<OCCLUSION_WIDTH;x++)
+      occlusion.Depth[y][x] = 1.0f;
+  occlusion.OccludersDrawn = occlusion.ColumnsTested = 0;
+  occlusion.Hidden.clear();
+  for(size_t i=0;i<occlusion.Occluders.size();i++)
+    rasterizeOccluder(occlusion.Occluders[i]);
+
+  for(size_t n=0;n<occlusion.Chunks.size();n++)
+  {
+    const OcclusionChunk& chunk = occlusion.Chunks[n];
+    int i0 = chunk.Row0, j0 = chunk.Column0;
+    bool hidden = occlusionBoxHidden(gridCorner(i0+CHUNK_SIZE, j0, 0), gridCorner(i0, j0+CHUNK_SIZE, chunk.MaxHeight));
+    if(!hidden)
+    {
+      hidden = true;
+      for(int r=0;r<CHUNK_SIZE && hidden;r++)
+        for(int c=0;c<CHUNK_SIZE && hidden;c++)
+          if(chunk.Heights[r][c] != 0)
+          {
+            occlusion.ColumnsTested++;
+            hidden = occlusionBoxHidden(gridCorner(i0+r+1, j0+c, 0), gridCorner(i0+r, j0+c+1, chunk.Heights[r][c]));
+          }
+    }
+    if(hidden)
+      occlusion.Hidden.pb(chunk.Index);
+  }
+}
 
+void occlusionWorker ()
+{
+  std::unique_lock<std::mutex> lock(occlusion.Lock);
+  for(;;)
+  {
+    while(!occlusion.Busy && !occlusion.Quit)
+      occlusion.Wake.wait(lock);
+    if(occlusion.Quit)
+      return;
+    lock.unlock();
+    runOcclusionJob();
+    lock.lock();
+    occlusion.Busy = false;
+    occlusion.Ready = true;
+  }
+}
+
+// Registered with atexit() when the worker starts, so it is joined before the globals go
+void stopOcclusionWorker ()
+{
+  {
+    std::lock_guard<std::mutex> lock(occlusion.Lock);
+    occlusion.Quit = true;
+  }
+  occlusion.Wake.notify_one();
+  occlusion.Worker.join();
+}
+
+// Takes the worker's answer for the last frame, when it has one, and hands
+// it this frame's camera and the chunks that passed the frustum test. When
+// the worker is still busy, the frame goes without a new job and without
+// occlusion culling.
+void exchangeOcclusionJob (const glm::mat4& VP, const vector<int>& candidates)
+{
+  if(!occlusion.Started)
+  {
+    occlusion.Started = true;
+    occlusion.Worker = std::thread(occlusionWorker);
+    atexit(stopOcclusionWorker);
+  }
+  std::lock_guard<std::mutex> lock(occlusion.Lock);
+  occlusion.Frame++;
+  occlusion.ChunkHidden.clear();
+  if(occlusion.Busy)
+  {
+    occlusion.JobsSkipped++;
+    return;
+  }
+  if(occlusion.Ready)
+  {
+    occlusion.Ready = false;
+    if(occlusion.JobFrame == occlusion.Frame-1) // older answers are for a camera since moved
+    {
+      occlusion.ChunkHidden.assign(world.Chunks.size(), 0);
+      for(size_t i=0;i<occlusion.Hidden.size();i++)
+        occlusion.ChunkHidden[occlusion.Hidden[i]] = 1;
+    }
+    else
+      occlusion.ResultsDropped++;
+    occlusion.Results++;
+    occlusion.TotalOccluders += occlusion.OccludersDrawn;
+    occlusion.TotalColumns += occlusion.ColumnsTested;
+  }
+
+  occlusion.VP = VP;
+  occlusion.Occluders.clear();
+  occlusion.Chunks.resize(candidates.size());
+  for(size_t n=0;n<candidates.size();n++)
+  {
+    int index = candidates[n];
+    const WorldChunk& chunk = world.Chunks[index];
+    OcclusionChunk& copy = occlusion.Chunks[n];
+    copy.Index = index;
+    copy.Row0 = index/world.ChunkColumns*CHUNK_SIZE;
+    copy.Column0 = index%world.ChunkColumns*CHUNK_SIZE;
+    copy.MaxHeight = chunk.MaxHeight;
+    memcpy(copy.Heights, chunk.Heights, sizeof(copy.Heights));
+    occlusion.Occluders.insert(occlusion.Occluders.end(), world.Occluders[index].begin(), world.Occluders[index].end());
+  }
+  occlusion.Jobs++;
+  occlusion.JobFrame = occlusion.Frame;
+  occlusion.Busy = true;
+  occlusion.Wake.notify_one();
+}
+
+void printOcclusionCounters ()
+{
+  const OcclusionCuller& o = occlusion;
+  if(o.Results == 0)
+    return;
+  printf("Occlusion culling: %lu jobs (%lu frames found the worker busy, %lu answers came too late), %.1f occluders and %.1f columns per job, %lu of %lu chunks hidden\n",
+         o.Jobs, o.JobsSkipped, o.ResultsDropped, (double)o.TotalOccluders/o.Results, (double)o.TotalColumns/o.Results, o.ChunksHidden, o.ChunksTested);
+}
+
+// Called by createWorld(): a job posted for the old world must not hide chunks of the new one
+void forgetOcclusion ()
+{
+  std::lock_guard<std::mutex> lock(occlusion.Lock);
+  occlusion.ChunkHidden.clear();
+  occlusion.JobFrame = -1;
+}
+
+bool chunkOccluded (int index)
+{
+  return index < (int)occlusion.ChunkHidden.size() && occlusion.ChunkHidden[index];
+}
+
+// Queues every chunk the camera can see, and that the occlusion culler did not
+// find hidden last frame: its greedy mesh and one instanced draw of
+// wireframes. Call after Matrices.view is set for the frame.
+void submitWorld ()
+{
+  updateWorldMeshes();
   glm::mat4 VP = Matrices.projection * Matrices.view;
+  Frustum frustum = extractFrustum(VP);
+  cullingStats.Frames++;
+  vector<int> candidates;
+  for(int i=0;i<world.ChunkRows;i++)
+    for(int j=0;j<world.ChunkColumns;j++)
+      if(world.Chunks[i*world.ChunkColumns + j].MaxHeight > 0 && chunkVisible(frustum, i, j))
+        candidates.pb(i*world.ChunkColumns + j);
+  exchangeOcclusionJob(VP, candidates);
+
+  for(size_t n=0;n<candidates.size();n++)
+  {
+    occlusion.ChunksTested++;
+    if(chunkOccluded(candidates[n]))
+    {
+      occlusion.ChunksHidden++;
+      continue;
+    }
+    const WorldChunk& chunk = world.Chunks[candidates[n]];
+    if(chunk.Filled != NULL)
+      submitDraw(chunk.Filled, glm::mat4(1.0f));
+    if(chunk.Wire != NULL && chunk.Wire->NumInstances > 0)
+      submitInstanced(chunk.Wire);
+  }
+}
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
-// cout << dont_show1 << dont_show << endl;
-if(z_turn==1)
+
+float camera_rotation_angle = 90;
+float rectangle_rotation = 0;
+float triangle_rotation = 0;
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+
+/* A flight under the game's gravity, in closed form. Each tick it moves Step,
+   less Fall*Fall downwards, and Fall grows by Rate; so after n ticks it has
+   fallen n F^2 + F R n(n-1) + R^2 (n-1)n(2n-1)/6. That holds for fractional
+   n too, so where it is, and when it comes down through a height, are exact
+   rather than found a tick late by stepping */
+struct Trajectory {
+  glm::vec2 Origin;   // along, up at tick 0
+  glm::vec2 Step;     // a tick's move, before gravity
+  float Fall, Rate;
+};
+
+glm::vec2 trajectoryAt (const Trajectory& arc, float ticks)
 {
-  // draw_cuboid(forplayer,-3+ho_t,2+fall-0.3,vo_t+0.8,1,0,1);
-  // draw_cuboid(forplayer,-2.8+ho_t,2+fall,vo_t+0.8,-1,0,1);
-  if(onboard==0)
+  double n = ticks, F = arc.Fall, R = arc.Rate;
+  double fallen = n*F*F + F*R*n*(n-1) + R*R*(n-1)*n*(2*n-1)/6;
+  return glm::vec2(arc.Origin.x + n*arc.Step.x, arc.Origin.y + n*arc.Step.y - fallen);
+}
+
+// When, in ticks from 0, it comes down through height; -1 if it never does
+float trajectoryLanding (const Trajectory& arc, float height)
+{
+  // Height above the mark as a cubic in n, falling from its apex on
+  double F = arc.Fall, R = arc.Rate;
+  double c0 = arc.Origin.y - height, c1 = arc.Step.y - F*F + F*R - R*R/6, c2 = R*R/2 - F*R, c3 = -R*R/3;
+  double apex = 0;
+  if(c3 < 0)
   {
-    forboardmovement = vo_t+0.8-0.6+(toaddv*z_position);
+    double d = c2*c2 - 3*c3*c1;
+    if(d > 0)
+      apex = max(0.0, (-c2 - sqrt(d))/(3*c3));
   }
-  else
+  else if(c1 >= 0)
+    return -1;
+  #define ABOVE(n) (c0 + (n)*(c1 + (n)*(c2 + (n)*c3)))
+  if(ABOVE(apex) < 0)
+    return -1;
+  double low = apex, high = apex + 1;
+  while(ABOVE(high) > 0)
+    high = apex + 2*(high - apex);
+  for(int i=0; i<60; i++)
   {
-    if(jump_initiated==0)
-      forboardmovement = board_position-4.55+(toaddv*z_position);
+    double middle = (low + high)/2;
+    if(ABOVE(middle) > 0)
+      low = middle;
     else
-      forboardmovement = storeinitialposition + (toaddv*z_position);
+      high = middle;
   }
-  draw_cube(body,-2.9+ho_t-0.1+(horizontal_position*toaddh),5-((9-player_height)*0.4)+vertical_position,forboardmovement);
+  #undef ABOVE
+  return high;
 }
-// cout << -2.9+ho_t-0.1 << " " << -2.9+ho_t-0.1+horizontal_position <<  " " << horizontal_position << "(((" << endl;
 
-if(x_turn==1 && dont_show==0)
+// The player's jump, from where it leaves the ground
+Trajectory playerJump ()
 {
-  // draw_cuboid(forplayer,-3+ho_t,2+fall,vo_t+0.8,1,1,0);
-  // draw_cuboid(forplayer,-3+ho_t,2+fall,vo_t+0.8,-1,1,0);
-  draw_cube(body_x,-3+ho_t-0.1+(horizontal_position*toaddh),5-((9-player_height)*0.4)+vertical_position,vo_t+0.8-0.8+(toaddv*z_position));      
+  Trajectory arc = { glm::vec2(0, 0), glm::vec2(initial_velocity*cos(angle_thrown)*0.005, initial_velocity*sin(angle_thrown)*0.005), 0, 0.01 };
+  return arc;
+}
+
+// The first tick the jump is below where it left, when the game lands it
+int jumpLandingTick ()
+{
+  static const int landing = (int)floor(trajectoryLanding(playerJump(), 0)) + 1;
+  return landing;
+}
+
+/* Level validation. Plays the level on the grid the controls move on: a step
+   is half a column (0.2), a jump lands one column (0.4) ahead in the
+   direction of the last step. The rules are the game's, from the tile map:
+   stepBlocked() undoes a step, and playerFalls() drops a player at rest.
+   A fall ends the run. A jump also has to clear every column under its arc,
+   which the game does not check, so a level passing here is solvable there. */
+struct LevelPlayer {
+  int X, Z;   // in steps, as PlayerPosition
+  int Facing; // 0..3: +x, -x, +z rows (w), -z rows (s)
+};
+
+const int STEP_X[4] = { 1, -1, 0, 0 }, STEP_Z[4] = { 0, 0, 1, -1 };
+
+// The columns a jump passes over, relative to the one it starts above, and
+// the tallest column it clears over each, for a start square on a column
+// (odd: half a column in) and a jump forwards or backwards along the axis
+struct JumpArc {
+  vector<int> Cells[2][2];      // [odd][backwards]
+  vector<float> Clears[2][2];
+};
+
+JumpArc jumpArc ()
+{
+  JumpArc arc;
+  Trajectory jump = playerJump();
+  float landing = trajectoryLanding(jump, 0);
+  for(int odd=0;odd<2;odd++)
+    for(int backwards=0;backwards<2;backwards++)
+    {
+      // Over each column from when it crosses in until it crosses out or
+      // lands; the arc is lowest at one end or the other, and its ends are
+      // at the height it left from
+      float speed = backwards ? -jump.Step.x : jump.Step.x;
+      int last = (int)floor((odd*0.2 + speed*landing)/0.4);
+      for(int cell=0; ; cell += backwards ? -1 : 1)
+      {
+        float in = max(0.0f, ((backwards ? cell+1 : cell)*0.4f - odd*0.2f)/speed);
+        float out = min(landing, ((backwards ? cell : cell+1)*0.4f - odd*0.2f)/speed);
+        float low = min(in == 0 ? 0 : trajectoryAt(jump, in).y, out == landing ? 0 : trajectoryAt(jump, out).y);
+        arc.Cells[odd][backwards].pb(cell);
+        arc.Clears[odd][backwards].pb(WALK_HEIGHT + low/0.4);
+        if(cell == last)
+          break;
+      }
+    }
+  return arc;
+}
+
+// Whether the jump arc from (x, z) along a direction stays above the columns it passes
+bool levelJumpClears (const TileMap& map, int x, int z, int facing)
+{
+  static const JumpArc arc = jumpArc();
+  int origin = STEP_X[facing] ? x : z, odd = origin & 1, backwards = STEP_X[facing] + STEP_Z[facing] < 0;
+  int start = (origin - odd)/2;
+  const vector<int>& cells = arc.Cells[odd][backwards];
+  for(size_t i=0;i<cells.size();i++)
+  {
+    int row = STEP_Z[facing] ? start + cells[i] : stepTile(z), column = STEP_X[facing] ? start + cells[i] : stepTile(x);
+    if(tileHeight(map, row, column) > arc.Clears[odd][backwards][i])
+      return false;
+  }
+  return true;
+}
+
+/* Reachability graph: for every position on the map, in steps, the moves the
+   rules above allow from it. A step either moves, or is undone by a blocking
+   tile and only turns the player; the jump depends on the facing, so there is
+   one per facing. A move is missing when it leaves the map or ends where the
+   player falls. Search states are (position, facing), so a position's moves
+   fit in 16 bits:
+
+     bits 0..7   two bits per step direction: REACH_MOVES or REACH_TURNS
+     bits 8..11  the jump is legal, one bit per facing
+     bit 12      a player at rest there stays put
+     bit 15      worked out; a position's moves are worked out when a search
+                 first reaches it, and kept
+
+   The graph for the game's map (reach) is cached: createWorld() drops it and
+   setWorldHeight() marks the tile, and the next query forgets only the
+   positions whose moves can see a marked tile. */
+const int MOVE_JUMP = 4;          // moves 0..3 are the steps, as Facing
+const int REACH_MOVES = 1, REACH_TURNS = 2;
+const int REACH_JUMP = 1 << 8, REACH_REST = 1 << 12, REACH_KNOWN = 1 << 15;
+
+struct ReachGraph {
+  bool Built;
+  int Width, Depth;               // positions from -1, as levelSolvable() always had
+  vector<uint16_t> Moves;         // Depth x Width, 0 until worked out
+  vector< pair<int,int> > Dirty;  // tiles changed since it was built
+  int Reach;                      // how many tiles away a position's moves look
+  // Search scratch, kept between queries; Cost is -1 for states not reached
+  vector<int> Cost, Parent, Touched;
+  vector< vector<int> > Open;
+} reach;
+
+int reachIndex (const ReachGraph& graph, int x, int z)
+{
+  return (z+1)*graph.Width + x+1;
+}
+
+bool reachInside (const ReachGraph& graph, int x, int z)
+{
+  return x >= -1 && z >= -1 && x < graph.Width-1 && z < graph.Depth-1;
+}
+
+uint16_t positionMoves (const ReachGraph& graph, const TileMap& map, int x, int z)
+{
+  uint16_t moves = REACH_KNOWN;
+  bool rests = !playerFalls(map, x, z, WALK_HEIGHT);
+  if(rests)
+    moves |= REACH_REST;
+  for(int move=0; move<4; move++)
+  {
+    int nx = x + STEP_X[move], nz = z + STEP_Z[move];
+    if(stepBlocked(map, nx, nz, STEP_X[move] != 0))
+    {
+      if(rests)
+        moves |= REACH_TURNS << 2*move;
+    }
+    else if(reachInside(graph, nx, nz) && !playerFalls(map, nx, nz, WALK_HEIGHT))
+      moves |= REACH_MOVES << 2*move;
+    nx = x + 2*STEP_X[move];
+    nz = z + 2*STEP_Z[move];
+    if(levelJumpClears(map, x, z, move) && reachInside(graph, nx, nz) && !playerFalls(map, nx, nz, WALK_HEIGHT))
+      moves |= REACH_JUMP << move;
+  }
+  return moves;
+}
+
+uint16_t reachMoves (ReachGraph& graph, const TileMap& map, int x, int z)
+{
+  uint16_t& moves = graph.Moves[reachIndex(graph, x, z)];
+  if(!moves)
+    moves = positionMoves(graph, map, x, z);
+  return moves;
+}
+
+void buildReachGraph (ReachGraph& graph, const TileMap& map)
+{
+  graph.Width = 2*map.Columns + 1;
+  graph.Depth = 2*map.Rows + 1;
+  graph.Moves.assign(graph.Width*graph.Depth, 0);
+  graph.Dirty.clear();
+  graph.Cost.assign(graph.Moves.size()*4, -1);
+  graph.Parent.resize(graph.Moves.size()*4);
+  graph.Touched.clear();
+  if(!graph.Reach)
+  {
+    // A position looks at tiles as far as its jump passes, one more for the
+    // landing and one more for the row beside it
+    JumpArc arc = jumpArc();
+    for(int odd=0; odd<2; odd++)
+      for(int backwards=0; backwards<2; backwards++)
+        for(size_t i=0; i<arc.Cells[odd][backwards].size(); i++)
+          graph.Reach = max(graph.Reach, abs(arc.Cells[odd][backwards][i]));
+    graph.Reach += 2;
+  }
+  graph.Built = true;
+}
+
+// Brings the graph up to date with the map
+void updateReachGraph (ReachGraph& graph, const TileMap& map)
+{
+  if(!graph.Built || graph.Width != 2*map.Columns + 1 || graph.Depth != 2*map.Rows + 1
+     || graph.Dirty.size()*(2*graph.Reach+1)*(2*graph.Reach+1) > (size_t)map.Rows*map.Columns)
+  {
+    buildReachGraph(graph, map);
+    return;
+  }
+  for(size_t i=0; i<graph.Dirty.size(); i++)
+  {
+    int row = graph.Dirty[i].F, column = graph.Dirty[i].S;
+    for(int z=max(-1, 2*(row-graph.Reach)); z<=min(graph.Depth-2, 2*(row+graph.Reach)+1); z++)
+      for(int x=max(-1, 2*(column-graph.Reach)); x<=min(graph.Width-2, 2*(column+graph.Reach)+1); x++)
+        graph.Moves[reachIndex(graph, x, z)] = 0;
+  }
+  graph.Dirty.clear();
+}
+
+void resetReachGraph ()
+{
+  reach.Built = false;
+}
+
+void invalidateReach (int row, int column)
+{
+  if(reach.Built)
+    reach.Dirty.pb(mp(row, column));
+}
+
+// Steps from a position to the nearest on a tile: 2t and 2t+1, and -1 on tile 0
+int stepsToTile (int steps, int tile)
+{
+  int first = tile == 0 ? -1 : 2*tile;
+  return steps < first ? first - steps : max(0, steps - (2*tile+1));
 }
+
+// Moves left at least, from (x, z) to the goal tile
+int routeEstimate (int x, int z, int goalRow, int goalColumn)
+{
+  return (stepsToTile(x, goalColumn) + stepsToTile(z, goalRow) + 1)/2;
+}
+
+/* The shortest route, in moves, from a player at rest to any position on the
+   goal tile, or false when there is none. A* over the graph: a move goes at
+   most two steps along one axis, so half the steps left to the goal tile,
+   rounded up, never overestimates, and changes by at most one a move. */
+bool findRoute (ReachGraph& graph, const TileMap& map, LevelPlayer start, int goalRow, int goalColumn, vector<int>& route)
+{
+  updateReachGraph(graph, map);
+  route.clear();
+  if(!reachInside(graph, start.X, start.Z) || !(reachMoves(graph, map, start.X, start.Z) & REACH_REST))
+    return false;
+  for(size_t i=0; i<graph.Touched.size(); i++)
+    graph.Cost[graph.Touched[i]] = -1;
+  graph.Touched.clear();
+  for(size_t i=0; i<graph.Open.size(); i++)
+    graph.Open[i].clear();
+
+  // Open states by estimated length, from the start's; a move adds 0 to 2 to
+  // it, so the buckets are taken in order and never revisited
+  int first = reachIndex(graph, start.X, start.Z)*4 + start.Facing;
+  int least = routeEstimate(start.X, start.Z, goalRow, goalColumn);
+  graph.Cost[first] = 0;
+  graph.Parent[first] = -1;
+  graph.Touched.pb(first);
+  if(graph.Open.empty())
+    graph.Open.resize(1);
+  graph.Open[0].pb(first);
+  for(size_t bucket=0; bucket<graph.Open.size(); bucket++)
+    for(size_t n=0; n<graph.Open[bucket].size(); n++)
+    {
+      int state = graph.Open[bucket][n], position = state/4;
+      int x = position%graph.Width - 1, z = position/graph.Width - 1;
+      int cost = graph.Cost[state];
+      if(cost + routeEstimate(x, z, goalRow, goalColumn) != least + (int)bucket)
+        continue; // a stale entry, reached more cheaply since
+      if(stepTile(z) == goalRow && stepTile(x) == goalColumn)
+      {
+        // Walk back; the move that reached a state shows in its facing and position
+        for(int s=state; graph.Parent[s] >= 0; s=graph.Parent[s])
+        {
+          int moved = abs(s/4 - graph.Parent[s]/4);
+          route.pb(moved == 2 || moved == 2*graph.Width ? MOVE_JUMP : s%4);
+        }
+        reverse(route.begin(), route.end());
+        return true;
+      }
+      uint16_t moves = reachMoves(graph, map, x, z);
+      for(int move=0; move<5; move++)
+      {
+        int facing = move, nx = x, nz = z;
+        if(move < 4)
+        {
+          int step = (moves >> 2*move) & 3;
+          if(!step)
+            continue;
+          if(step == REACH_MOVES)
+          {
+            nx += STEP_X[move];
+            nz += STEP_Z[move];
+          }
+        }
+        else
+        {
+          facing = state%4;
+          if(!(moves & (REACH_JUMP << facing)))
+            continue;
+          nx += 2*STEP_X[facing];
+          nz += 2*STEP_Z[facing];
+        }
+        int next = reachIndex(graph, nx, nz)*4 + facing;
+        if(graph.Cost[next] >= 0 && graph.Cost[next] <= cost+1)
+          continue;
+        if(graph.Cost[next] < 0)
+          graph.Touched.pb(next);
+        graph.Cost[next] = cost+1;
+        graph.Parent[next] = state;
+        size_t to = cost+1 + routeEstimate(nx, nz, goalRow, goalColumn) - least;
+        if(to >= graph.Open.size())
+          graph.Open.resize(to+1);
+        graph.Open[to].pb(next);
+      }
+    }
+  return false;
+}
+
+bool levelSolvable (const LevelText& level)
+{
+  const LevelInfo& info = level.Info;
+  if(info.GoalRow < 0)
+    return true;
+  TileMap map;
+  createTileMap(map, level.Rows, level.Columns);
+  for(int i=0;i<level.Rows;i++)
+    for(int j=0;j<level.Columns;j++)
+      setTileHeight(map, i, j, level.Heights[i*level.Columns + j]);
+  ReachGraph graph;
+  graph.Built = false;
+  graph.Reach = 0;
+  vector<int> route;
+  LevelPlayer start = { 2*info.SpawnColumn, 2*info.SpawnRow, 0 };
+  return findRoute(graph, map, start, info.GoalRow, info.GoalColumn, route);
+}
+
+// The 'h' key: how far the goal is by the shortest route, and its next move
+void printRouteHint ()
+{
+  if(levelInfo.GoalRow < 0)
+    return;
+  LevelPlayer player = { playerPosition.X, playerPosition.Z, ind ? 0 : ina ? 1 : inw ? 2 : 3 };
+  vector<int> route;
+  if(player_height != WALK_HEIGHT || jump_initiated || ridePlatform >= 0
+     || !findRoute(reach, tiles, player, levelInfo.GoalRow, levelInfo.GoalColumn, route))
+    cout << "Hint: no route to the goal from here" << endl;
+  else if(route.empty())
+    cout << "Hint: at the goal" << endl;
+  else
+    cout << "Hint: " << route.size() << " moves to the goal, next " << (route[0] == MOVE_JUMP ? "space" : string(1, "daws"[route[0]])) << endl;
+}
+
+/* Level generator (--generate): levels from a seed, on every core. Level i
+   depends only on the seed and i, never on which thread made it; candidates
+   are drawn until one passes levelSolvable(), GENERATOR_ATTEMPTS at most,
+   since at some sizes (a single row, say) hardly any are. */
+const int GENERATOR_ATTEMPTS = 2000;
+
+struct LevelGenerator {
+  int Count;
+  unsigned Seed;
+  int Rows, Columns;
+  string Directory;
+  std::atomic<int> Next;      // next level to make
+  std::atomic<long> Attempts; // candidates drawn, over all levels
+  std::atomic<int> Failed;    // levels that could not be made or written
+} generator;
+
+// False when no candidate passed in GENERATOR_ATTEMPTS
+bool generateLevel (int index, LevelText& level)
+{
+  for(int attempt=0; attempt<GENERATOR_ATTEMPTS; attempt++)
+  {
+    std::seed_seq seeds = { generator.Seed, (unsigned)index, (unsigned)attempt };
+    std::mt19937 rng(seeds);
+    level.Rows = generator.Rows;
+    level.Columns = generator.Columns;
+    level.Heights.assign(level.Rows*level.Columns, 9);
+    for(size_t i=0;i<level.Heights.size();i++)
+    {
+      int roll = rng()%100;
+      if(roll < 15)
+        level.Heights[i] = 10 + rng()%3; // a tower, blocking the way
+      else if(roll < 30)
+        level.Heights[i] = 1 + rng()%8;  // a drop
+    }
+    level.Info.SpawnRow = level.Info.SpawnColumn = 0;
+    level.Info.GoalRow = level.Rows-1;
+    level.Info.GoalColumn = level.Columns-1;
+    level.Heights[0] = level.Heights[level.Heights.size()-1] = 9;
+
+    // A board sweeping a few rows along some column, as in the first level
+    level.Platforms.clear();
+    int column = rng()%level.Columns, first = rng()%level.Rows, last = min(level.Rows-1, first + 1 + (int)(rng()%4));
+    LevelPlatform board = { -3 + column*0.4f, 4.75f, 0, 4.7f - last*0.4f, 4.7f - first*0.4f, (1 + rng()%3)/100.0f };
+    board.Start = (board.Low + board.High)/2;
+    level.Platforms.pb(board);
+
+    generator.Attempts++;
+    if(levelSolvable(level))
+      return true;
+  }
+  return false;
+}
+
+void generatorWorker ()
+{
+  LevelText level;
+  for(int index; (index = generator.Next++) < generator.Count; )
+  {
+    char name[32];
+    sprintf(name, "/level%05d.lvl", index);
+    if(!generateLevel(index, level))
+    {
+      cerr << "Error: no solvable candidate for level " << index << " in " << GENERATOR_ATTEMPTS << " attempts" << endl;
+      generator.Failed++;
+    }
+    else if(!writeLevelFile(level, (generator.Directory + name).c_str()))
+      generator.Failed++;
+  }
+}
+
+void generateLevels ()
+{
+  mkdir(generator.Directory.c_str(), 0755);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<std::thread> workers(max(1u, std::thread::hardware_concurrency()));
+  for(size_t i=0;i<workers.size();i++)
+    workers[i] = std::thread(generatorWorker);
+  for(size_t i=0;i<workers.size();i++)
+    workers[i].join();
+  double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  printf("Generated %d %dx%d levels in %s on %d threads: %.1f ms, %.2f candidates per level\n",
+         generator.Count - generator.Failed, generator.Rows, generator.Columns, generator.Directory.c_str(), (int)workers.size(),
+         ms, (double)generator.Attempts/max(1, generator.Count));
+  if(generator.Failed > 0)
+    printf("%d of %d levels failed\n", (int)generator.Failed, generator.Count);
+}
+
+void draw_cube(VAO *obj,float x_pos,float y_pos,float z_pos)
+{
+  Matrices.model = glm::mat4(1.0f);
+
+  glm::mat4 translateRectangle = glm::translate (glm::vec3(x_pos, y_pos, z_pos));        // glTranslatef
+  // glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(1,1,1)); // rotate about vector (-1,1,1)
+  Matrices.model *= (translateRectangle);
+
+  // queued; flushRenderQueue() applies the camera and draws it
+  submitDraw(obj, Matrices.model);
+}
+
+// Same as draw_cube for geometry that moves every frame: transformed on the CPU
+// and appended to the frame's stream batch instead of costing its own draw
+void draw_cube(const DynamicMesh& mesh,float x_pos,float y_pos,float z_pos)
+{
+  Matrices.model = glm::translate (glm::vec3(x_pos, y_pos, z_pos));
+  submitDynamic(mesh, Matrices.model);
+}
+
+void draw_cuboid(VAO *obj,float x_pos,float y_pos,float z_pos,int flag,int x_walk,int z_walk)
+{
+  Matrices.model = glm::mat4(1.0f);
+  glm::mat4 translateRectangle = glm::translate (glm::vec3(x_pos, y_pos, z_pos));
+  glm::mat4 translateRectangle1 = glm::translate (glm::vec3(0, 0.2, 0));
+  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(0, -0.2, 0));
+  glm::mat4 rotateRectangle = glm::rotate((float)(flag*rectangle_rotation*M_PI/180.0f), glm::vec3(z_walk,0,x_walk));
+  if(no_of_walks!=0)
+  {
+    Matrices.model *= (translateRectangle * translateRectangle1 * rotateRectangle * translateRectangle2);
+  }
+  else
+  {
+      Matrices.model *= (translateRectangle);
+  }
+  submitDraw(obj, Matrices.model);
+}
+
+
+double GetFloatPrecision(double value, double precision)
+{
+    return (floor((value * pow(10, precision) + 0.5)) / pow(10, precision)); 
+}
+
+
+/* One tick of the game: the jump, the platforms, falling and the win */
+void tick ()
+{
+keepPreviousState();
+simulation.Ticks++;
 if(jump_initiated==1)
 {
+  glm::vec2 arc = trajectoryAt(playerJump(), ++jump_ticks);
   if(ind==1 || ina==1)
   {
-    horizontal_position = jump(horizontal_position);
+    horizontal_position = arc.x;
   }
   else
   {
-    z_position = jump(z_position);
+    z_position = arc.x;
   }
+  vertical_position = arc.y;
   if(ind==1)
   {
     toaddh = 1;
@@ -997,83 +3493,37 @@ if(jump_initiated==1)
     toaddv = -1;
   if(ins==1)
     toaddv = 1;
-  if(vertical_position<0)
+  if(jump_ticks>=jumpLandingTick())
   {
     jump_initiated=0;
     horizontal_position=0;
     z_position=0;
     vertical_position=0;
-    if(onboard==1 && work==1)
-    {
-      onboard=0;
-      vo_t -= 1.0;
-      work;
-    }
-    time_travel=0;
+    jump_ticks=0;
     if(ina==1)
-      ho_t -= 0.4;
+      placePlayer(playerPosition.X - 2, playerPosition.Z);
     if(ind==1)
-      ho_t += 0.4;
+      placePlayer(playerPosition.X + 2, playerPosition.Z);
     if(inw==1)
-      vo_t -= 0.4;
+      placePlayer(playerPosition.X, playerPosition.Z + 2);
     if(ins==1)
-      vo_t += 0.4;
+      placePlayer(playerPosition.X, playerPosition.Z - 2);
   }
 
 }
-// draw_cube(small_cube,1,5,3);
-draw_cube(board,-3,4.75,board_position-4.7);
-if(board_position>2.3 && board_position<3.5)
-{
-  board_position+=(0.02*dire);
-  board_position = GetFloatPrecision(board_position,2);
-  // cout << "in adding " << endl; 
-}
-else if(board_position>=3.5)
-{
-  dire*=-1;
-  board_position+=(0.05*dire);
-  board_position = GetFloatPrecision(board_position,2);
-}
-else if(board_position<=2.3)
-{
-  dire*=-1;
-  board_position+=(0.05*dire);
-  board_position = GetFloatPrecision(board_position,2);
-}
-draw_cube(plane,-68,-10,60);
-for(int i=0;i<10;i++)
-{
-  for(int j=0;j<10;j++)
-  {
-      for(int k=0;k<test[i][j];k++)
-      {
-        if(k%2==0 && k<=9)
-          draw_cube(rectangle,-3+j*0.4,-2+k*0.4+3.4,-i*0.4);
-        else
-          draw_cube(trans,-3+j*0.4,-2+k*0.4+3.4,-i*0.4);
-      }
-  }
-}
-
+updatePlatforms();
 
 // cout << int(ho_t*10)/4 << " " <<  -1*int(vo_t*10)/4 << endl;
-if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]<player_height && jump_initiated==0)
+if(tileHeight(tiles, playerRow(), playerColumn())<player_height && jump_initiated==0)
 {
-  if(board_position-4.3>-1.3 && (5-((9-player_height)*0.4)+vertical_position)>4.8 && (-2.9+ho_t-0.1+(horizontal_position*toaddh)<=-2.8))
+  if(ridePlatform<0)
   {
-    // cout << "1---" << endl;
-    onboard=1;
+    ridePlatform = platformUnder(ho_t-3,vo_t,5-((9-player_height)*0.4)+vertical_position);
   }
-  // cout << int(-1*vo_t)%4 <<
-  if(int(10*vo_t)%4==0 && int(10*ho_t)%4==0 && onboard==0)
+  if(ridePlatform<0 && playerFalls(tiles, playerPosition.X, playerPosition.Z, player_height))
   {
     player_height -= 0.04;
   }
-  else if(test[(-1*int(vo_t*10)/4)+1][int(ho_t*10)/4]<player_height && onboard==0)
-  {
-    player_height -=0.04;
-  }
   // cout << vo_t+0.8-0.6+(toaddv*z_position) << endl;
 	// if(fall>-3.6)
 	// 	fall-=0.06;
@@ -1081,27 +3531,29 @@ if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]<player_height && jump_initiated==0)
 	// 	arrow_work =1;
 }
 
-if(( (int(ho_t*10)/4)<0 || ((-1*int(vo_t*10)/4)<0)) && player_height>0)
+if((playerColumn()<0 || playerRow()<0) && player_height>0)
 {
   player_height -=0.04;
   cout << player_height << endl;
 }
 
 // cout << vo_t+0.8-0.6+(toaddv*z_position) << endl;
-// cout  << test[-1*int(vo_t*10)/4+1][int(ho_t*10)/4] << "***"<< int(vo_t*10)/4 << " &&&&&" << vo_t <<endl;
+// cout  << worldHeight(-1*int(vo_t*10)/4+1, int(ho_t*10)/4) << "***"<< int(vo_t*10)/4 << " &&&&&" << vo_t <<endl;
 
 // cout << -2.9+ho_t-0.1+(horizontal_position*toaddh) << endl;
 
-if((-1*int(vo_t*10)/4)==9 && (int(ho_t*10)/4)==9)
+if(levelInfo.GoalRow>=0 && playerRow()==levelInfo.GoalRow && playerColumn()==levelInfo.GoalColumn)
 {
+  if(simulation.WonAt<0)
+    simulation.WonAt = simulation.Ticks;
   cout << "You Win" << endl;
 }
 
 
 
-// cout << test[-1*int(vo_t*10)/4][int(ho_t*10)/4] << " " << -1*int(vo_t*10)/4 << " " << int(ho_t*10)/4 <<  endl;
+// cout << worldHeight(-1*int(vo_t*10)/4, int(ho_t*10)/4) << " " << -1*int(vo_t*10)/4 << " " << int(ho_t*10)/4 <<  endl;
 
-// if(test[-1*int(vo_t*10)/4][int(ho_t*10)/4]>9)
+// if(worldHeight(-1*int(vo_t*10)/4, int(ho_t*10)/4)>9)
 // {
 //   obstacle=1;
 //   if(x_walk==1)
@@ -1128,6 +3580,78 @@ if((rectangle_rotation>25 || rectangle_rotation<-25) && no_of_walks>=0)
   rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
 }
 
+// The scene, alpha of the way from before the last tick to now
+void draw (float alpha)
+{
+	
+  // clear the color and depth in the frame buffer
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // use the loaded shader program
+  // Don't change unless you know what you are doing
+  stateUseProgram (programID);
+
+  // Eye - Location of camera. Don't change unless you are sure!!
+  //glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
+  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
+  // Target - Where is the camera looking at.  Don't change unless you are sure!!
+  glm::vec3 target (0, 0, 0);
+  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+  glm::vec3 up (0, 1, 0);
+
+  
+  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+  //  Don't change unless you are sure!!
+  glm::vec3 body = glm::mix(simulation.Body, playerBody(), alpha), stand = glm::mix(simulation.Stand, playerStand(), alpha);
+  if(only_player==0 && top_view==0 && player_eye==0)
+    Matrices.view = glm::lookAt(glm::vec3(0+x+shiftx,20+y+shifty,0+z), glm::vec3(-1,3+0,-1.8), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+  else if(only_player==1)
+    Matrices.view = glm::lookAt(glm::vec3(0+x1+shiftx,y+shifty,z1), body+glm::vec3(0,0,0.2), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+  else if(top_view==1)
+    Matrices.view = glm::lookAt(glm::vec3(0,30,0), glm::vec3(-1,3+0,-1.8), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+  else
+  {
+    if(inw==1)
+      Matrices.view = glm::lookAt(stand+glm::vec3(0,-0.1,0.2), glm::vec3(-2,-2+y,-80), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+    if(ins==1)
+      Matrices.view = glm::lookAt(stand+glm::vec3(0,-0.1,0.3), glm::vec3(-2,-2+y,80), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+
+    if(ind==1)
+      Matrices.view = glm::lookAt(stand+glm::vec3(-1,0,0.1), glm::vec3(40,y+stand.y-3,1), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+    if(ina==1)
+      Matrices.view = glm::lookAt(stand+glm::vec3(-1,2,0.1), glm::vec3(-40,y+stand.y-3,1), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+    // dont_show=1;
+  }
+  // 200,5+y,-00
+
+  // Projection * View reaches the shaders once, through the camera uniform block,
+  // when flushRenderQueue() runs; objects only supply their model transform
+// cout << dont_show1 << dont_show << endl;
+if(z_turn==1)
+{
+  // draw_cuboid(forplayer,-3+ho_t,2+fall-0.3,vo_t+0.8,1,0,1);
+  // draw_cuboid(forplayer,-2.8+ho_t,2+fall,vo_t+0.8,-1,0,1);
+  draw_cube(::body,body.x,body.y,body.z+0.2);
+}
+// cout << -2.9+ho_t-0.1 << " " << -2.9+ho_t-0.1+horizontal_position <<  " " << horizontal_position << "(((" << endl;
+
+if(x_turn==1 && dont_show==0)
+{
+  // draw_cuboid(forplayer,-3+ho_t,2+fall,vo_t+0.8,1,1,0);
+  // draw_cuboid(forplayer,-3+ho_t,2+fall,vo_t+0.8,-1,1,0);
+  draw_cube(body_x,body.x-0.1,body.y,body.z);
+}
+// draw_cube(small_cube,1,5,3);
+for(int i=0; i<platforms.Count; i++)
+  draw_cube(board,platforms.X[i],platforms.Y[i],platformDrawZ(i,alpha));
+// Floor, recorded once per level, and the tower cubes, chunk by chunk
+submitStaticScene();
+submitWorld();
+
+  // Everything submitted above is sorted and drawn here
+  flushRenderQueue();
+}
+
 /* Initialise glfw window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
 GLFWwindow* initGLFW (int width, int height)
@@ -1153,7 +3677,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    glfwSwapInterval( simulation.Vsync ? 1 : 0 );
 
     /* --- register callbacks with GLFW --- */
 
@@ -1183,29 +3707,34 @@ void initGL (GLFWwindow* window, int width, int height)
     /* Objects should be created before any other gl function and shaders */
 	// Create the models
 	// createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
-	rectangle = createRectangle (0.2,0.2,0.2,GL_FILL);
-  trans = createRectangle(0.2,0.2,0.2,GL_LINE);
   forplayer = createRectangle(0.05,0.2,0.05,GL_FILL);
-  body = createRectangle(0.2,0.2,0.05,GL_FILL);
-  body_x = createRectangle(0.05,0.2,0.2,GL_FILL);
+  body = rectangleMesh(0.2,0.2,0.05);
+  body_x = rectangleMesh(0.05,0.2,0.2);
   arrow2 = createTriangle(0.4,0.3,0,0);
   small_cube = createRectangle(0.05,0.05,0.05,GL_FILL);
-  board = createRectangle(0.2,0.05,0.2,GL_FILL);
-  createPlane();
+  board = rectangleMesh(0.2,0.05,0.2);
+  cube = createRectangle(0.2,0.2,0.2,GL_FILL);
+  loadStartLevel();
+  recordStaticScene();
 	// Create and compile our GLSL program from the shaders
 	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	instancedProgramID = LoadShaders( "Sample_GL_instanced.vert", "Sample_GL.frag" );
+	// Get a handle for our "Model" uniform; the camera goes in a shared uniform block
+	Matrices.ModelID = glGetUniformLocation(programID, "Model");
+	vector<GLuint> programs;
+	programs.push_back(programID);
+	programs.push_back(instancedProgramID);
+	createCameraBlock(programs);
 
 	
 	reshapeWindow (window, width, height);
 
     // Background color of the scene
-	glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
-	glClearDepth (1.0f);
+	stateClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
+	stateClearDepth (1.0f);
 
-	glEnable (GL_DEPTH_TEST);
-	glDepthFunc (GL_LEQUAL);
+	stateEnable (GL_DEPTH_TEST);
+	stateDepthFunc (GL_LEQUAL);
 
     cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
@@ -1213,20 +3742,367 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* Headless mode (--headless <frames> [--dump <prefix>]): no window, an EGL
+   surfaceless context (Mesa llvmpipe is enough) rendering into an offscreen
+   framebuffer, as fast as it can, for a fixed number of frames */
+struct Headless {
+    bool Enabled;
+    int Frames;
+    string DumpPrefix;       // when set, frame i is written to <prefix>NNNN.ppm
+#ifdef HEADLESS_EGL
+    EGLDisplay Display;
+    EGLContext Context;
+#endif
+    GLuint Framebuffer;
+    GLuint Renderbuffers[2]; // color, depth
+} headless;
+
+/* Simulation mode (--simulate <ticks> [--script <file>] [--sessions <n>]):
+   the level played without a window or GL, n times over from its start, for
+   regression and load testing. A script has a "<tick> <key>" line for each
+   key pressed, w, a, s, d or space, before the numbered tick (from 0); a #
+   starts a comment. An "expect <tick> <state>" line records the state the
+   level is in after that many ticks, as printed at the end of a run, and
+   every session is held to it */
+struct SimulatedRun {
+    int Ticks, Sessions;
+    string ScriptPath;
+    vector< pair<long, char> > Script; // in tick order
+    long ExpectAt;                     // 0 when the script records no state
+    uint64_t Expected;
+} simulated;
+
+void usage (const char* program)
+{
+    cerr << "usage: " << program << " [--level <file>] [--tick-rate <hz>] [--no-vsync] [--headless <frames> [--dump <prefix>]]" << endl;
+    cerr << "       " << program << " [--level <file>] --simulate <ticks> [--script <file>] [--sessions <n>]" << endl;
+    cerr << "       " << program << " --import <text level> <binary level>" << endl;
+    cerr << "       " << program << " --generate <count> <directory> [--seed <n>] [--size <rows> <columns>]" << endl;
+    exit(EXIT_FAILURE);
+}
+
+void parseArguments (int argc, char** argv)
+{
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        if (arg == "--headless" && i+1 < argc) {
+            headless.Enabled = true;
+            headless.Frames = atoi(argv[++i]);
+        }
+        else if (arg == "--dump" && i+1 < argc)
+            headless.DumpPrefix = argv[++i];
+        else if (arg == "--simulate" && i+1 < argc)
+            simulated.Ticks = max(1, atoi(argv[++i]));
+        else if (arg == "--script" && i+1 < argc)
+            simulated.ScriptPath = argv[++i];
+        else if (arg == "--sessions" && i+1 < argc)
+            simulated.Sessions = max(1, atoi(argv[++i]));
+        else if (arg == "--level" && i+1 < argc)
+            levelPath = argv[++i];
+        else if (arg == "--tick-rate" && i+1 < argc)
+            simulation.TickRate = max(1.0, atof(argv[++i]));
+        else if (arg == "--no-vsync")
+            simulation.Vsync = false;
+        else if (arg == "--generate" && i+2 < argc) {
+            generator.Count = atoi(argv[++i]);
+            generator.Directory = argv[++i];
+            if (generator.Count <= 0)
+                usage(argv[0]);
+        }
+        else if (arg == "--seed" && i+1 < argc)
+            generator.Seed = strtoul(argv[++i], NULL, 10);
+        else if (arg == "--size" && i+2 < argc) {
+            generator.Rows = atoi(argv[++i]);
+            generator.Columns = atoi(argv[++i]);
+            if (generator.Rows <= 0 || generator.Columns <= 0 || generator.Rows > LEVEL_MAX_SIZE || generator.Columns > LEVEL_MAX_SIZE)
+                usage(argv[0]);
+        }
+        else if (arg == "--import" && i+2 < argc) {
+            // Convert a text level to the binary form, without starting the game
+            LevelText level;
+            bool converted = readLevelText(argv[i+1], level) && writeLevelFile(level, argv[i+2]);
+            if (converted && !levelSolvable(level))
+                cerr << "Warning: " << argv[i+1] << ": the goal cannot be reached without the board" << endl;
+            exit(converted ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        else
+            usage(argv[0]);
+    }
+    if (!headless.DumpPrefix.empty() && !headless.Enabled)
+        usage(argv[0]); // frames are only dumped when rendered offscreen
+}
+
+void initHeadless (int width, int height)
+{
+#ifdef HEADLESS_EGL
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    headless.Display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (headless.Display == EGL_NO_DISPLAY || !eglInitialize(headless.Display, NULL, NULL)) {
+        cerr << "Error: no EGL display for headless rendering" << endl;
+        exit(EXIT_FAILURE);
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglChooseConfig(headless.Display, configAttribs, &config, 1, &numConfigs);
+    EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.Context = eglCreateContext(headless.Display, numConfigs ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (headless.Context == EGL_NO_CONTEXT || !eglMakeCurrent(headless.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.Context)) {
+        cerr << "Error: could not create a surfaceless OpenGL 3.3 context" << endl;
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // Stands in for the window's default framebuffer for the whole run
+    glGenFramebuffers(1, &headless.Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+    glGenRenderbuffers(2, headless.Renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.Renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.Renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.Renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.Renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cerr << "Error: offscreen framebuffer is incomplete" << endl;
+        exit(EXIT_FAILURE);
+    }
+#else
+    cerr << "Error: headless mode needs EGL, which this build does not have" << endl;
+    exit(EXIT_FAILURE);
+#endif
+}
+
+/* Write the offscreen color buffer as a binary PPM, top row first */
+void dumpFrame (int frame, int width, int height)
+{
+    vector<GLubyte> pixels(width*height*4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+
+    char name[16];
+    sprintf(name, "%04d.ppm", frame);
+    ofstream file((headless.DumpPrefix + name).c_str(), ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    for (int y=height-1; y>=0; y--)
+        for (int x=0; x<width; x++)
+            file.write((const char*)&pixels[4*(y*width + x)], 3);
+}
+
+/* Render headless.Frames frames unthrottled, a tick each, and report what they cost */
+void runHeadless (int width, int height)
+{
+    double total = 0, slowest = 0;
+    for (int frame=0; frame<headless.Frames; frame++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        tick();
+        draw(1);
+        glFinish(); // count the GPU's share of the frame too
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        total += ms;
+        slowest = max(slowest, ms);
+
+        if (!headless.DumpPrefix.empty())
+            dumpFrame(frame, width, height);
+    }
+    if (headless.Frames > 0)
+        printf("Headless: %d frames, %.3f ms/frame average, %.3f ms slowest\n", headless.Frames, total/headless.Frames, slowest);
+}
+
+bool readScript (const char* path, SimulatedRun& run)
+{
+    ifstream file(path);
+    if (!file) {
+        cerr << "Error: cannot open script " << path << endl;
+        return false;
+    }
+    string line;
+    for (int number=1; getline(file, line); number++) {
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        string first, key, rest;
+        if (!(words >> first))
+            continue;
+        if (first == "expect") {
+            string state;
+            if (!(words >> run.ExpectAt >> state) || (words >> rest) || run.ExpectAt < 1
+                || state.size() != 16 || state.find_first_not_of("0123456789abcdef") != string::npos) {
+                cerr << "Error: " << path << ":" << number << ": expected expect <tick> <state, 16 hex digits>" << endl;
+                return false;
+            }
+            run.Expected = strtoull(state.c_str(), NULL, 16);
+            continue;
+        }
+        char* end;
+        long at = strtol(first.c_str(), &end, 10);
+        if (*end != 0 || !(words >> key) || (words >> rest) || at < 0 || (key != "space" && (key.size() != 1 || !strchr("wasd", key[0])))) {
+            cerr << "Error: " << path << ":" << number << ": expected <tick> w, a, s, d or space" << endl;
+            return false;
+        }
+        run.Script.push_back(make_pair(at, key == "space" ? ' ' : key[0]));
+    }
+    stable_sort(run.Script.begin(), run.Script.end(), [](const pair<long, char>& a, const pair<long, char>& b) { return a.first < b.first; });
+    return true;
+}
+
+/* Back to where startLevel() left the level, and the player at rest */
+void restartLevel ()
+{
+    jump_initiated = 0;
+    horizontal_position = vertical_position = z_position = 0;
+    jump_ticks = 0;
+    toaddh = 1;
+    toaddv = -1;
+    ind = 1;
+    ina = inw = ins = 0;
+    x_turn = 0;
+    z_turn = 1;
+    no_of_walks = 0;
+    rectangle_rotation = 0;
+    rectangle_rot_dir = 1;
+    vector<LevelPlatform> list = levelPlatforms;
+    startLevel(levelInfo, list.empty() ? NULL : &list[0], list.size());
+}
+
+// FNV-1a over everything a tick reads and writes, to tell sessions apart
+uint64_t simulationHash ()
+{
+    uint64_t hash = 14695981039346656037ull;
+    #define MIX(value) for (size_t b=0; b<sizeof(value); b++) hash = (hash ^ ((const unsigned char*)&(value))[b]) * 1099511628211ull
+    MIX(playerPosition.X); MIX(playerPosition.Z); MIX(player_height);
+    MIX(jump_initiated); MIX(horizontal_position); MIX(vertical_position); MIX(z_position); MIX(jump_ticks);
+    MIX(ind); MIX(ina); MIX(inw); MIX(ins); MIX(ridePlatform); MIX(simulation.WonAt);
+    for (int i=0; i<platforms.Count; i++)
+        MIX(platforms.Position[i]);
+    #undef MIX
+    return hash;
+}
+
+void scriptInput (char key)
+{
+    switch (key) {
+        case 'a': stepInput(-1, 0); break;
+        case 'd': stepInput(1, 0); break;
+        case 'w': stepInput(0, 1); break;
+        case 's': stepInput(0, -1); break;
+        case ' ': jumpInput(); break;
+    }
+}
+
+// One session from the level's start, the keys before the ticks they name;
+// the state it ends in, and in atExpect the state after simulated.ExpectAt ticks
+uint64_t playSession (uint64_t& atExpect)
+{
+    const vector< pair<long, char> >& script = simulated.Script;
+    restartLevel();
+    size_t next = 0;
+    for (long t=0; t<simulated.Ticks; t++) {
+        for (; next < script.size() && script[next].first == t; next++)
+            scriptInput(script[next].second);
+        tick();
+        if (t+1 == simulated.ExpectAt)
+            atExpect = simulationHash();
+    }
+    return simulationHash();
+}
+
+/* Play simulated.Sessions sessions, report where they ended and what they
+   cost. Every session has to end the same, or the game is not deterministic,
+   and be in the state the script expects, or the game plays differently */
+bool runSimulation ()
+{
+    if (!simulated.ScriptPath.empty() && !readScript(simulated.ScriptPath.c_str(), simulated))
+        return false;
+    if (simulated.ExpectAt > simulated.Ticks) {
+        cerr << "Error: " << simulated.ScriptPath << " expects a state after " << simulated.ExpectAt << " ticks; simulate at least that many" << endl;
+        return false;
+    }
+
+    // The game's own prints would be most of the time spent
+    streambuf* console = cout.rdbuf(NULL);
+    uint64_t expected = 0;
+    int mismatched = 0, unexpected = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int session=0; session<simulated.Sessions; session++) {
+        uint64_t atExpect = 0, hash = playSession(atExpect);
+        if (session == 0)
+            expected = hash;
+        else if (hash != expected)
+            mismatched++;
+        if (simulated.ExpectAt > 0 && atExpect != simulated.Expected)
+            unexpected++;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout.rdbuf(console);
+
+    printf("Simulated %d sessions of %d ticks in %.1f ms: %.0f sessions/s, %.0f ticks/s\n", simulated.Sessions, simulated.Ticks,
+           ms, simulated.Sessions/(ms/1000), (double)simulated.Sessions*simulated.Ticks/(ms/1000));
+    printf("Ended at step (%d, %d), tile (%d, %d), height %.2f, %s", playerPosition.X, playerPosition.Z,
+           playerRow(), playerColumn(), player_height, jump_initiated ? "jumping" : "at rest");
+    if (ridePlatform >= 0)
+        printf(" on platform %d", ridePlatform);
+    if (simulation.WonAt >= 0)
+        printf(", goal reached at tick %ld", simulation.WonAt);
+    else
+        printf(", goal not reached");
+    printf("; state %016llx\n", (unsigned long long)expected);
+    if (mismatched > 0)
+        cerr << "Error: " << mismatched << " of " << simulated.Sessions << " sessions ended in another state" << endl;
+    if (unexpected > 0)
+        fprintf(stderr, "Error: %d of %d sessions were not in state %016llx after %ld ticks\n", unexpected, simulated.Sessions,
+                (unsigned long long)simulated.Expected, simulated.ExpectAt);
+    return mismatched == 0 && unexpected == 0;
+}
+
 int main (int argc, char** argv)
 {
 	int width = 600;
 	int height = 600;
 
+    generator.Rows = generator.Columns = 10;
+    simulated.Sessions = 1;
+    parseArguments(argc, argv);
+    if (generator.Count > 0) {
+        generateLevels();
+        exit(generator.Failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (simulated.Ticks > 0) {
+        loadStartLevel();
+        exit(runSimulation() ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (headless.Enabled) {
+        initHeadless(width, height);
+        initGL (NULL, width, height);
+        runHeadless(width, height);
+        printGLStateCounters();
+        printStreamCounters();
+        printCullingCounters();
+        exit(EXIT_SUCCESS);
+    }
+
     GLFWwindow* window = initGLFW(width, height);
 
 	initGL (window, width, height);
 
     double last_update_time = glfwGetTime(), current_time;
+    double last_frame_time = last_update_time, owed = 0;
     while (!glfwWindowShouldClose(window)) {
 
-        // OpenGL Draw commands
-        draw();
+        // The ticks owed since the last frame; after a stall, catch up a quarter second at most
+        current_time = glfwGetTime();
+        owed += min(current_time - last_frame_time, 0.25);
+        last_frame_time = current_time;
+        for (; owed >= 1/simulation.TickRate; owed -= 1/simulation.TickRate)
+            tick();
+
+        // OpenGL Draw commands, between the last tick and the next
+        draw(owed*simulation.TickRate);
 
         // Swap Frame Buffer in double buffering
         glfwSwapBuffers(window);
@@ -1242,6 +4118,9 @@ int main (int argc, char** argv)
         }
     }
 
+    printGLStateCounters();
+    printStreamCounters();
+    printCullingCounters();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }